@@ -89,10 +89,18 @@
 // -------------------------------------------------------------------
 
 
-#define cstbase_ver_major  '1'
+#define cstbase_ver_major  '2'
 #define cstbase_ver_minor  '1'
 
 #define cstbase_report_id 0x01
+#define cstbase_send_max 5  // bytes a report ID 1 'S' carries, after id,'S',n
+#define cstbase_batch_report_id 0x02
+#define cstbase_batch_size (64+1)  // report ID 2 incl. report id byte
+#define cstbase_event_report_id 0x03
+#define cstbase_resp_report_id 0x04
+#define cstbase_resp_size (64+1)  // report ID 4 incl. report id byte
+#define cstbase_status_report_id 0x05
+#define cstbase_status_size (16+1)  // report ID 5 incl. report id byte
 
 
 // serial number of this cst base station
@@ -114,10 +122,91 @@ RAMSNt my_RAMSN;
 #define OUT_DATA_BUFFER_ADDRESS (IN_DATA_BUFFER_ADDRESS + HID_INT_IN_EP_SIZE)
 #define FEATURE_DATA_BUFFER_ADDRESS (OUT_DATA_BUFFER_ADDRESS + HID_INT_OUT_EP_SIZE)
 #define FEATURE_DATA_BUFFER_ADDRESS_TAG @FEATURE_DATA_BUFFER_ADDRESS
+#define IN_DATA_BUFFER_ADDRESS_TAG @IN_DATA_BUFFER_ADDRESS
 #endif
 
 uint8_t hid_send_buf[USB_EP0_BUFF_SIZE] FEATURE_DATA_BUFFER_ADDRESS_TAG;
 
+// report ID 2 batches: commands arrive in batch_buf, answer built in 
+// batch_resp. too big for CtrlTrfData, and kept apart so answers can't
+// overwrite commands not yet run. while a batch waits or runs, the next
+// batch SET_REPORT & any batch GET_REPORT wait for it, see runCommands()
+uint8_t batch_buf[cstbase_batch_size];
+uint8_t batch_resp[cstbase_batch_size];
+
+// answers to the last RESP_SLOTS queries, each as in hid_send_buf, so
+// the host can have several queries going and pick its own out by seq.
+// GET_REPORT of report ID 4 returns all of it
+#define RESP_SLOTS 8  // power of 2, RESP_SLOTS*8 fits in report ID 4
+uint8_t resp_table[cstbase_resp_size];
+uint8_t respNext;  // slot for next answer, oldest one
+
+// report ID 1 SET_REPORTs wait here for the main loop to run them, so
+// the USB interrupt only copies them. see runCommands()
+// holds CMD_QUEUE_SIZE-1 commands. when full, the next SET_REPORT's data
+// stage is held off (host sees NAKs) until the main loop makes room
+#define CMD_QUEUE_SIZE 4  // power of 2
+uint8_t cmdQueue[CMD_QUEUE_SIZE][USB_EP0_BUFF_SIZE];
+volatile uint8_t cmdHead;      // next free slot
+volatile uint8_t cmdTail;      // next to run
+volatile uint8_t cmdsDropped;  // counts commands lost to a full queue
+uint16_t cmdsReceived;         // counts commands & batches from host
+
+// report ID 5 status snapshot, filled in when host asks. see sendStatus()
+uint8_t status_buf[cstbase_status_size];
+uint8_t uptimeTicks;           // Timer0 ticks into current second
+uint32_t uptimeSecs;
+volatile bit batchPending;     // batch_buf holds a batch not yet run, or running
+
+// control transfer the USB interrupt held off for the main loop
+#define DEFER_NONE      0
+#define DEFER_CMD       1  // report ID 1 SET_REPORT, command queue full
+#define DEFER_BATCH_SET 2  // report ID 2 SET_REPORT, batch_buf in use
+#define DEFER_BATCH_GET 3  // report ID 2 GET_REPORT, batch_resp not done
+volatile uint8_t deferred;
+
+// events for the host, pushed as report ID 3 input reports on HID_EP
+// queued by ISR & main loop, sent from main loop. see sendEvents()
+#define EVENT_QUEUE_SIZE 16  // power of 2
+uint8_t eventTypes[EVENT_QUEUE_SIZE];
+uint8_t eventData[EVENT_QUEUE_SIZE];
+volatile uint8_t eventHead;  // next free slot
+volatile uint8_t eventTail;  // next to send
+uint8_t eventSeq;            // counts events sent
+volatile uint8_t eventsDropped;  // counts events lost to a full queue
+uint8_t hid_event_buf[HID_INT_IN_EP_SIZE] IN_DATA_BUFFER_ADDRESS_TAG;
+USB_HANDLE eventHandle = 0;
+
+// bytes from the watch, filled by ISR, drained by host with 'r' commands
+// ISR only moves rxHead, command handling only moves rxTail
+#define RX_RING_SIZE 32  // power of 2
+uint8_t rxRing[RX_RING_SIZE];
+volatile uint8_t rxHead;      // next free slot
+volatile uint8_t rxTail;      // next to hand to host
+volatile uint8_t rxOverflow;  // counts bytes lost to a full ring or UART overrun
+
+// buttons, sampled each Timer0 tick (~5.5ms), stable after two equal samples
+// see handleKeys()
+#define KEY_MINUS  0b00001000  // RA3
+#define KEY_MODE   0b00010000  // RA4
+#define KEY_PLUS   0b00100000  // RA5
+#define KEYS_MASK  (KEY_MINUS|KEY_MODE|KEY_PLUS)
+#define KEY_TICK_US 5461  // 48MHz/4, 1:256 prescaler, 256 counts
+#define keyMs(ms) ((uint16_t)((ms)*1000UL/KEY_TICK_US))
+volatile uint8_t keyTicks;     // counts Timer0 overflows
+volatile uint8_t keysSample = KEYS_MASK;  // last sample, low = pressed
+volatile uint8_t keysStable = KEYS_MASK;  // debounced
+enum { KEYS_IDLE, KEYS_STEP, KEYS_PAUSE, KEYS_COUNT, KEYS_HOLD };
+uint8_t keyState = KEYS_IDLE;
+uint8_t keyLastTick;
+uint8_t keyStepper;   // KEY_PLUS or KEY_MINUS, while stepping
+uint8_t keyRepeats;   // steps sent this press
+uint8_t keyPresses;   // extra presses counted after a step
+uint8_t keyReleased;
+uint16_t keyWait;     // ticks left in pause or count
+uint16_t keyHold;     // ticks held in two or three button combo
+uint16_t diagTicks;   // ticks left at 5V for diagnostic battery reading
+
 uint8_t usbHasBeenSetup = 0;  // set in USBCBInitEP()
 #define usbIsSetup (USBGetDeviceState() == CONFIGURED_STATE)
 
@@ -133,6 +222,7 @@ volatile bit batteryCharged=0;
 //unsigned char udata;
 // new things
 volatile bit timeToUpdateState=0;
+volatile bit docked=0;  // watch said "Hi" lately
 volatile uint8_t lastRxByte=0;
 
 
@@ -144,13 +234,18 @@ volatile uint8_t lastRxByte=0;
 static void InitializeSystem(void);
 void USBCBSendResume(void);
 void USBHIDCBSetReportComplete(void);
+void USBHIDCBSetBatchComplete(void);
 
 static char tohex(uint8_t num);
 inline void loadSerialNumber(void);
 void updateState(void);
 void handleKeys(void);
-unsigned char countStepsRA3(void);
-unsigned char countStepsRA4(void);
+void queueEvent(uint8_t type, uint8_t data);
+void checkButtons(void);
+void sendEvents(void);
+uint8_t rxRingRead(uint8_t* buf, uint8_t max);
+void runCommands(void);
+void sendStatus(void);
 
 
 // ****************************************************************************
@@ -163,7 +258,10 @@ int main(void)
     USBDeviceAttach();
     
     while (1) {
+        runCommands();
         updateState();
+        checkButtons();
+        sendEvents();
         handleKeys();
         CLRWDT();  // tickle watchdog
     }
@@ -222,7 +320,7 @@ static void InitializeSystem(void)
     PSA=0;      //Timer Clock Source is from Prescaler
     T0CS=0;     //Prescaler gets clock from FCPU (48MHz)
 
-    TMR0IE=0;   //Disable TIMER0 Interrupt
+    TMR0IE=1;   //Enable TIMER0 Interrupt, ticks for keys & state updates
 
     // set up UART
     uart_init();
@@ -281,29 +379,58 @@ void interrupt ISRCode()
 
         timeToUpdateState = 1;  // just signal so we can handle it outside the ISR
 
+        uint8_t k = PORTA & KEYS_MASK;  // debounce keys
+        if( k == keysSample ) keysStable = k;
+        keysSample = k;
+        keyTicks++;
+        if( ++uptimeTicks >= keyMs(1000) ) {
+            uptimeTicks = 0;
+            uptimeSecs++;
+        }
+
         TMR0IF=0; //Clear Flag 
     }
     
+    // uart transmit interrupt
+    uart_txService();
+
     // uart receive interrupt
+    if( OERR ) {            // overrun stops the receiver until CREN toggles
+        CREN = 0;
+        CREN = 1;
+        rxOverflow++;
+    }
     if( RCIE && RCIF ) {    // receive interrupt enabled and p recieve a byte
-        lastRxByte = RCREG;
-        if(RCREG=='H') { //it said "Hi"
-            if(!TMR0IE){
-                TMR0IE=1;   //Enable TIMER0 Interrupt
+        uint8_t c = RCREG;  // read once, each read pops the receive FIFO
+        lastRxByte = c;
+        uint8_t next = (rxHead + 1) & (RX_RING_SIZE-1);
+        if( next != rxTail ) {
+            rxRing[rxHead] = c;
+            rxHead = next;
+        } else {
+            rxOverflow++;
+        }
+        queueEvent( 'R', c );
+        if(c=='H') { //it said "Hi"
+            if(!docked){
+                docked=1;
                 //LATCbits.LATC3 = 1;
                 batteryCharged=0;
                 PWM2DCH=0xFF;
+                queueEvent( 'H', 0 );  // just docked
             }
             timeOutCounter=0;
-        }else if(RCREG=='B'){
+        }else if(c=='B'){
             batteryCharged=1;
             PWM2DCH=0x44;
             PORTCbits.RC2=0; //once we get the answer back we can bump voltage back up to 12V out
+            queueEvent( 'B', 0 );
         }
-        else if(RCREG=='N'){
+        else if(c=='N'){
             batteryCharged=0;
             //PWM2DCH=0x44;       
             PORTCbits.RC2=0; //12V out
+            queueEvent( 'N', 0 );
         }
     }
     
@@ -317,6 +444,10 @@ void interrupt ISRCode()
 void updateState(void)
 {
     if( !timeToUpdateState ) return;
+    if( !docked || diagTicks ) {  // no watch, or diagnostic reading under way
+        timeToUpdateState = 0;
+        return;
+    }
 
     //Code for LED pulse
     if(!batteryCharged){
@@ -344,7 +475,7 @@ void updateState(void)
     if(timeOutCounter>=500) { //timed out
         //LATCbits.LATC3 = 0; //turn off LED
         PWM2DCH=0x00;
-        TMR0IE=0;
+        docked=0;
         timeOutCounter=0;
     }
     
@@ -355,142 +486,239 @@ void updateState(void)
 
 //
 // Deal with keypresses on base station.
-// Called in main loop to handle keypresses
-// code from original CST-Base_Station-1454
+// Called in main loop, steps along once per Timer0 tick, never waits.
+// Sends the watch the same codes as the original CST-Base_Station-1454:
+//  plus held:  'u' per step, 'U' after 10 steps, 'P' after 22
+//  minus held: 'd' per step, 'D' after 10 steps, 'W' after 22
+//  after each step, extra presses in the next 510ms: one more step
+//   ('u'/'d'), or 'a'/'z' for 2, 'b'/'y' for 3 or more
+//  mode pressed: 'M'
+//  all three held 5s: 'S', plus & minus held 5s: 'X' then 3s at 5V
 //
 void handleKeys(void)
 {
-    static int i=0;
-    while(PORTAbits.RA5==0 && PORTAbits.RA3==1 && PORTAbits.RA4==1){//only plus pressed
-        i++;
-        unsigned char extraPresses;
-        if(i<=10){// 5 sec
-            uart_putc('u'); //up one
-        }else if(i>22){
-            uart_putc('P'); //up hour
-            _delay_ms(250);
-        }else if(i>10){
-            uart_putc('U'); //up ten
-            _delay_ms(125);
-        }
-        extraPresses = countStepsRA3();//returns extra button presses the user inputs before the watch has the chance to update
-        if (extraPresses==1){
-            uart_putc('u');
-        }else if(extraPresses==2){
-            uart_putc('a');
-        }else if(extraPresses>2){
-            uart_putc('b');
-        }
-    }
-    
-    while(PORTAbits.RA5==1 && PORTAbits.RA3==0 && PORTAbits.RA4==1){//only minus pressed
-        i++;
-        unsigned char extraPresses;
-        if(i<=10){// 5 sec
-            uart_putc('d'); //up one
-        }else if(i>22){
-            uart_putc('W'); //up ten
-            _delay_ms(250);
-        }else if(i>10){
-            uart_putc('D'); //up hour
-            _delay_ms(125);
-        }
-        extraPresses = countStepsRA4();//returns extra button presses the user inputs before the watch has the chance to update
-        if (extraPresses==1){
-            uart_putc('d');
-        }else if(extraPresses==2){
-            uart_putc('z');
-        }else if(extraPresses>2){
-            uart_putc('y');
+    uint8_t now = keyTicks;
+    uint8_t n = now - keyLastTick;  // ticks since last time
+    if( n == 0 ) return;
+    keyLastTick = now;
+
+    uint8_t p = ~keysStable & KEYS_MASK;  // buttons pressed
+    uint8_t up = (keyStepper == KEY_PLUS);
+
+    if( diagTicks ) {  // diagnostic battery reading, keys ignored meanwhile
+        if( diagTicks > n ) {
+            diagTicks -= n;
+            return;
         }
+        diagTicks = 0;
+        PORTCbits.RC2=0; //12V out
     }
-    
-    if(PORTAbits.RA4==0 && !modeButtonPressed){ //mode pressed, changes between 12 and 24 hour mode
+
+    if( (p & KEY_MODE) && !modeButtonPressed ) { //mode pressed, changes between 12 and 24 hour mode
         modeButtonPressed=1;
         uart_putc('M');
-        _delay_ms(10);   //debounce
-        
-    }else if(PORTAbits.RA4==1 && modeButtonPressed){
+    }else if( !(p & KEY_MODE) && modeButtonPressed ) {
         modeButtonPressed=0;
-        _delay_ms(10);   //debounce
     }
-    
-    // easter egg to swap color
-    while(PORTAbits.RA5==0 && PORTAbits.RA3==0 && PORTAbits.RA4==0){
-        _delay_ms(1);
-        if(i>5000){// 5 sec
-            uart_putc('S'); //swap colors
-            i=0;
+
+    switch( keyState ) {
+    case KEYS_IDLE:
+        keyRepeats = 0;
+        keyHold = 0;
+        if( p == KEY_PLUS || p == KEY_MINUS ) {
+            keyStepper = p;
+            keyState = KEYS_STEP;
         }
-        i++;
-    }
-    
-    //Diagnostic Mode
-    while(PORTAbits.RA5==0 && PORTAbits.RA3==0 && PORTAbits.RA4==1){
-        _delay_ms(1);
-        if(i>5000){// 5 sec
-            uart_putc('X'); //diagnostic mode
-            PORTCbits.RC2=1; //5V out
-            _delay_ms(1000); //delay, so an accurate battery reading can be made 12V charging brings battery up to 4.15 automatically)
-            _delay_ms(1000);
-            _delay_ms(1000);
-            PORTCbits.RC2=0; //12V out
-            i=0;
+        else if( p == KEYS_MASK || p == (KEY_PLUS|KEY_MINUS) ) {
+            keyState = KEYS_HOLD;
+        }
+        break;
+
+    case KEYS_STEP:  // send a step, pause longer the longer it's held
+        keyRepeats++;
+        if( keyRepeats <= 10 ) {  // 5 sec
+            uart_putc( up ? 'u' : 'd' );  //up/down one
+            keyWait = 0;
+        }else if( keyRepeats > 22 ) {
+            uart_putc( up ? 'P' : 'W' );  //up hour / down ten
+            keyWait = keyMs(250);
+        }else {
+            uart_putc( up ? 'U' : 'D' );  //up ten / down hour
+            keyWait = keyMs(125);
+        }
+        keyState = KEYS_PAUSE;
+        break;
+
+    case KEYS_PAUSE:
+        if( keyWait > n ) {
+            keyWait -= n;
+            break;
+        }
+        keyWait = keyMs(510);
+        keyPresses = 0;
+        keyReleased = 0;
+        keyState = KEYS_COUNT;
+        break;
+
+    case KEYS_COUNT:  // extra presses the user makes before the watch updates
+        if( !(p & keyStepper) ) {
+            keyReleased = 1;
+        }else if( keyReleased ) {
+            keyReleased = 0;
+            keyPresses++;
+        }
+        if( keyWait > n ) {
+            keyWait -= n;
+            break;
         }
-        i++;
+        if( keyPresses == 1 ) {
+            uart_putc( up ? 'u' : 'd' );
+        }else if( keyPresses == 2 ) {
+            uart_putc( up ? 'a' : 'z' );
+        }else if( keyPresses > 2 ) {
+            uart_putc( up ? 'b' : 'y' );
+        }
+        keyState = ( p == keyStepper ) ? KEYS_STEP : KEYS_IDLE;
+        break;
+
+    case KEYS_HOLD:  // easter egg to swap color, or diagnostic mode
+        if( p != KEYS_MASK && p != (KEY_PLUS|KEY_MINUS) ) {
+            keyState = KEYS_IDLE;
+            break;
+        }
+        keyHold += n;
+        if( keyHold > keyMs(5000) ) {  // 5 sec
+            keyHold = 0;
+            if( p == KEYS_MASK ) {
+                uart_putc('S'); //swap colors
+            }else {
+                uart_putc('X'); //diagnostic mode
+                PORTCbits.RC2=1; //5V out
+                diagTicks = keyMs(3000); //so an accurate battery reading can be made 12V charging brings battery up to 4.15 automatically)
+            }
+        }
+        break;
     }
 }
 
-//
-// code from original CST-Base_Station-1454
-unsigned char countStepsRA3(void)
+
+// ------------- events to host ----------------------------------------------
+
+// queue an event for the host, dropping it if queue is full
+// called from ISR, and from main loop with interrupts off
+void queueEvent(uint8_t type, uint8_t data)
 {
-    int i;
-    int pressCount=0;
-    unsigned char buttonUp=0;
-    for(i=0; i<510; i++){
-        if(PORTAbits.RA5==1 && !buttonUp){ // released
-            buttonUp=1;
-            _delay_ms(10);   //debounce
-            i+=10;
-        }else if(PORTAbits.RA5==0 && buttonUp){ // pressed
-            buttonUp=0;
-            pressCount++;
-            _delay_ms(10);   //debounce
-            i+=10;
-        }
-        _delay_ms(1);
+    uint8_t h = eventHead;
+    uint8_t next = (h + 1) & (EVENT_QUEUE_SIZE-1);
+    if( next == eventTail ) {
+        eventsDropped++;
+        return;
     }
-    return pressCount;
+    eventTypes[h] = type;
+    eventData[h]  = data;
+    eventHead = next;
 }
 
-//
-// code from original CST-Base_Station-1454
-unsigned char countStepsRA4(void)
+// queue a 'b' event when the debounced buttons change
+// data is the button bits RA3,RA4,RA5 shifted down to bits 0,1,2
+void checkButtons(void)
 {
-    int i;
-    int pressCount=0;
-    unsigned char buttonUp=0;
-    for(i=0; i<510; i++){
-        if(PORTAbits.RA3==1 && !buttonUp){ // released
-            buttonUp=1;
-            _delay_ms(10);   //debounce
-            i+=10;
-        }else if(PORTAbits.RA3==0 && buttonUp){ // pressed
-            buttonUp=0;
-            pressCount++;
-            _delay_ms(10);   //debounce
-            i+=10;
-        }
-        _delay_ms(1);
+    static uint8_t last = KEYS_MASK >> 3;
+    uint8_t b = keysStable >> 3;
+    if( b != last ) {
+        last = b;
+        GIE = 0;
+        queueEvent( 'b', last );
+        GIE = 1;
     }
-    return pressCount;
 }
 
+// send next queued event as input report, if endpoint is free
+// { 3, type, data, seq, dropped, 0,0,0 }
+//   'b' buttons changed, data = button bits
+//   'R' byte from watch, data = byte
+//   'H' watch docked, 'B' battery charged, 'N' battery charging
+// seq counts events sent, dropped counts events lost to a full queue
+void sendEvents(void)
+{
+    if( !usbIsSetup || HIDTxHandleBusy(eventHandle) ) return;
+    if( eventTail == eventHead ) return;
+
+    uint8_t t = eventTail;
+    hid_event_buf[0] = cstbase_event_report_id;
+    hid_event_buf[1] = eventTypes[t];
+    hid_event_buf[2] = eventData[t];
+    hid_event_buf[3] = ++eventSeq;
+    hid_event_buf[4] = eventsDropped;
+    hid_event_buf[5] = 0;
+    hid_event_buf[6] = 0;
+    hid_event_buf[7] = 0;
+    eventTail = (t + 1) & (EVENT_QUEUE_SIZE-1);
+    eventHandle = HIDTxPacket(HID_EP, (BYTE*)hid_event_buf, HID_INT_IN_EP_SIZE);
+}
 
+// take up to max bytes from the watch out of rxRing, returns how many
+uint8_t rxRingRead(uint8_t* buf, uint8_t max)
+{
+    uint8_t n = 0;
+    uint8_t t = rxTail;
+    while( n < max && t != rxHead ) {
+        buf[n++] = rxRing[t];
+        t = (t + 1) & (RX_RING_SIZE-1);
+    }
+    rxTail = t;
+    return n;
+}
 
 // ------------- USB command handling ----------------------------------------
 
+// let a control transfer held off by UserSetReportHandler() or
+// UserGetReportHandler() go on. a new SETUP from the host (it gave up)
+// clears the stack's deferred flags, then there's nothing to resume
+static void resumeDeferred(uint8_t what)
+{
+    GIE = 0;
+    if( deferred == what ) {
+        deferred = DEFER_NONE;
+        if( USBOUTDataStageDeferred() || USBINDataStageDeferred() )
+            USBCtrlEPAllowDataStage();
+    }
+    GIE = 1;
+}
+
+// run commands the USB interrupt queued, in order they came
+// a batch runs after any single commands that were waiting
+void runCommands(void)
+{
+    while( cmdTail != cmdHead ) {
+        handleMessage( (const char*)cmdQueue[cmdTail] );
+        cmdTail = (cmdTail + 1) & (CMD_QUEUE_SIZE-1);
+        resumeDeferred( DEFER_CMD );
+    }
+    if( batchPending ) {
+        handleBatch();
+        batchPending = 0;  // batch_buf & batch_resp free again
+        resumeDeferred( DEFER_BATCH_SET );
+        resumeDeferred( DEFER_BATCH_GET );
+    }
+}
+
+// send set time command to watch, as "FHH:MM"
+static void watchSetTime(uint8_t H, uint8_t M)
+{
+    char buf[10];
+    sprintf(buf, "F%2.2d:%2.2d", H,M);
+    uart_puts( buf );  // send command to watch
+}
+
+// send raw bytes to watch
+static void watchSendBytes(const uint8_t* b, uint8_t cnt)
+{
+    for( uint8_t i=0; i< cnt; i++ ) { 
+        uart_putc( b[i] );
+    }
+}
+
 // handleMessage(char* msgbuf) -- main command router
 //
 // msgbuf[] is 8 bytes long
@@ -501,19 +729,36 @@ unsigned char countStepsRA4(void)
 // Available commands:
 //  - Set time                  format: { 1, 'T', H,M,S, ...
 //  - Send byte to watch        format: { 1, 'S', n, b, ...
-//  - Receive byte from watch   format: { 1, 'R', ...
+//  - Receive byte from watch   format: { 1, 'R', seq, ...
+//  - Read buffered watch bytes format: { 1, 'r', seq, max, ...
+//  - Get UART queue stats      format: { 1, 'q', seq, ...
 //  - 
 //  - Set Base LED              format: { 1, 'l', ...
-//  - Get Base Button State     format: { 1, 'b', ...
-//  - Get Base Version          format: { 1, 'v', 0,0,0
+//  - Get Base Button State     format: { 1, 'b', seq, ...
+//  - Get Base Version          format: { 1, 'v', seq, 0,0
 //
+// Queries ('R','b','v') put their answer in hid_send_buf for the host
+// to GET_REPORT, as { 1, cmd, seq, data... }.  'seq' is the host's
+// sequence byte from the request, written last so the host can tell
+// when the answer to its own request is ready.  Other commands leave
+// hid_send_buf alone.
+//
+// Each answer is also kept in the report ID 4 table, as 
+// { 4, slot0[8], slot1[8], ... }, so with different seqs the host can
+// have up to CMD_QUEUE_SIZE-1 queries waiting and collect their answers
+// in one GET_REPORT, in any order.
+//
+// Several commands can go in one transfer as a report ID 2 batch,
+// see handleBatch().
+//
+// Runs from the main loop, see runCommands().  The host can send more
+// commands meanwhile, up to CMD_QUEUE_SIZE-1; more wait in the USB
+// transfer until there's room.  A query's answer is there once its seq is.
 //
 void handleMessage(const char* msgbuf)
 {
-    // pre-load response with request, contains report id
-    memcpy( hid_send_buf, msgbuf, 8 );
-
     uint8_t cmd = msgbuf[1];
+    uint8_t seq = msgbuf[2];
 
     //
     //  Set Time                  format: { 1, 'T', H,M,S,      0,0,0 }
@@ -522,36 +767,63 @@ void handleMessage(const char* msgbuf)
         uint8_t H = msgbuf[2];
         uint8_t M = msgbuf[3];
         //uint8_t S = msgbuf[4];
-        
-        char buf[10];
-        sprintf(buf, "F%2.2d:%2.2d", H,M);
-     
-        uart_puts( buf );  // send command to watch
-        
+        watchSetTime( H, M );
+        return;
     }
     //
-    // Send bytes to watch        format: { 1, 'S', n, b1,b2,b3,b4,b5,b6 }
+    // Send bytes to watch        format: { 1, 'S', n, b1,b2,b3,b4,b5 }
     //
     else if( cmd == 'S' ) { 
         uint8_t cnt = msgbuf[2];
-        for( int i=0; i< cnt; i++ ) { 
-            uart_putc( msgbuf[3+i] );
-        }
+        if( cnt > cstbase_send_max ) cnt = cstbase_send_max;
+        watchSendBytes( (const uint8_t*)msgbuf+3, cnt );
+        return;
     }
+
+    // everything else is a query, start a fresh response
+    hid_send_buf[2] = 0;  // not ready
+    memset( hid_send_buf+3, 0, sizeof(hid_send_buf)-3 );
+
     //
-    // Get last byte from watch   format: { 1, 'R', 0,0,0, 0,0,0 }
+    // Get last byte from watch   format: { 1, 'R', seq, 0,0, 0,0,0 }
     //
-    else if( cmd == 'R' ) { 
+    if( cmd == 'R' ) { 
         hid_send_buf[3] = lastRxByte;
     }
     //
-    // Base Station button state  format: { 1, 'b' 0,0,0, 0,0,0 }
+    // Read buffered bytes        format: { 1, 'r', seq, max, 0, 0,0,0 }
+    //  answer is                         { 1, 'r', seq, n, overflow, b1,b2,b3 }
+    //  n bytes (at most 3, and max) taken from the ring, oldest first.
+    //  overflow counts bytes lost since power up, wrapping at 256
+    //
+    else if( cmd == 'r' ) {
+        uint8_t max = msgbuf[3];
+        if( max > USB_EP0_BUFF_SIZE-5 ) max = USB_EP0_BUFF_SIZE-5;
+        hid_send_buf[3] = rxRingRead( hid_send_buf+5, max );
+        hid_send_buf[4] = rxOverflow;
+    }
+    //
+    // UART queue stats           format: { 1, 'q', seq, 0,0, 0,0,0 }
+    //  answer is     { 1, 'q', seq, txDepth, txMaxDepth, txOverflow, 
+    //                  rxDepth, rxOverflow }
+    //  depths are bytes waiting now, or most ever waiting. overflows
+    //  count bytes dropped, wrapping at 256
+    //
+    else if( cmd == 'q' ) {
+        hid_send_buf[3] = uart_txDepth();
+        hid_send_buf[4] = txMaxDepth;
+        hid_send_buf[5] = txOverflow;
+        hid_send_buf[6] = (uint8_t)(rxHead - rxTail) & (RX_RING_SIZE-1);
+        hid_send_buf[7] = rxOverflow;
+    }
+    //
+    // Base Station button state  format: { 1, 'b', seq, 0,0, 0,0,0 }
     // 
     else if( cmd == 'b' ) {
         hid_send_buf[3] =  PORTA;  // just return all of PORTA because why not?
     }
     //
-    //  Get version               format: { 1, 'v', 0,0,0,        0,0, 0 }
+    //  Get version               format: { 1, 'v', seq, 0,0,       0,0, 0 }
     //
     else if( cmd == 'v' ) {
         hid_send_buf[3] = cstbase_ver_major;
@@ -560,6 +832,156 @@ void handleMessage(const char* msgbuf)
     else {
 
     }
+
+    hid_send_buf[0] = cstbase_report_id;
+    hid_send_buf[1] = cmd;
+    hid_send_buf[2] = seq;  // ready
+
+    // and into the table, seq last there too
+    uint8_t* slot = resp_table + 1 + (respNext * USB_EP0_BUFF_SIZE);
+    slot[2] = 0;
+    memcpy( slot+3, hid_send_buf+3, USB_EP0_BUFF_SIZE-3 );
+    slot[0] = cstbase_report_id;
+    slot[1] = cmd;
+    slot[2] = seq;
+    respNext = (respNext + 1) & (RESP_SLOTS-1);
+}
+
+// handleBatch() -- run several commands from one report ID 2 SET_REPORT
+//
+// batch_buf[] is 65 bytes long
+//  byte0 = report-id 2
+//  byte1 = 'B'
+//  byte2 = seq, as for queries
+//  byte3 = number of commands
+//  byte4.. = commands, each { cmd, n, args[n] }:
+//    - Set time                { 'T', 3, H,M,S }
+//    - Send bytes to watch     { 'S', n, b1..bn }
+//    - Get button state        { 'b', 0 }
+//    - Get last byte from watch { 'R', 0 }
+//    - Read buffered watch bytes { 'r', 1, max }
+//    - Get version             { 'v', 0 }
+//    - Get UART queue stats    { 'q', 0 }
+//
+// The answer goes in batch_resp for GET_REPORT of report ID 2, as
+// { 2, 'B', seq, count, results... }, one result per command run, each
+// { cmd, n, data[n] }: n=0 for 'T' & 'S', 1 for 'b' & 'R', 2 for 'v',
+// 5 for 'q' (as its single answer, so a batch of { 'S', n, ... }, 
+// { 'q', 0 } sends bytes and says how much room is left for more).
+// 'r' answers { overflow, bytes... }, n=1+bytes, taking as many bytes
+// from the ring as max and the room left allow.
+// Commands run in order, stopping at the first unknown or malformed one
+// or when the answer is full.  count says how many ran.  seq is written
+// last, same as for single queries.
+//
+void handleBatch(void)
+{
+    uint8_t seq = batch_buf[2];
+    uint8_t cnt = batch_buf[3];
+    uint8_t i = 4;  // next command in batch_buf
+    uint8_t o = 4;  // next result in batch_resp
+    uint8_t ran = 0;
+
+    batch_resp[2] = 0;  // not ready
+    memset( batch_resp+3, 0, sizeof(batch_resp)-3 );
+
+    while( ran < cnt ) {
+        if( i+2 > sizeof(batch_buf) ) break;
+        uint8_t cmd = batch_buf[i];
+        uint8_t n   = batch_buf[i+1];
+        const uint8_t* args = batch_buf + i + 2;
+        if( n > sizeof(batch_buf) - 2 - i ) break;  // runs off the end
+
+        uint8_t rn = (cmd == 'b' || cmd == 'R' || cmd == 'r') ? 1 : 
+                     (cmd == 'v') ? 2 : (cmd == 'q') ? 5 : 0;
+        if( rn+2 > sizeof(batch_resp) - o ) break;  // no room for answer
+
+        if(      cmd == 'T' && n >= 2 ) {
+            watchSetTime( args[0], args[1] );
+        }
+        else if( cmd == 'S' ) {
+            watchSendBytes( args, n );
+        }
+        else if( cmd == 'b' ) {
+            batch_resp[o+2] = PORTA;
+        }
+        else if( cmd == 'R' ) {
+            batch_resp[o+2] = lastRxByte;
+        }
+        else if( cmd == 'r' && n >= 1 ) {
+            uint8_t max = sizeof(batch_resp) - o - 3;
+            if( args[0] < max ) max = args[0];
+            rn += rxRingRead( batch_resp+o+3, max );
+            batch_resp[o+2] = rxOverflow;
+        }
+        else if( cmd == 'v' ) {
+            batch_resp[o+2] = cstbase_ver_major;
+            batch_resp[o+3] = cstbase_ver_minor;
+        }
+        else if( cmd == 'q' ) {
+            batch_resp[o+2] = uart_txDepth();
+            batch_resp[o+3] = txMaxDepth;
+            batch_resp[o+4] = txOverflow;
+            batch_resp[o+5] = (uint8_t)(rxHead - rxTail) & (RX_RING_SIZE-1);
+            batch_resp[o+6] = rxOverflow;
+        }
+        else {
+            break;
+        }
+        batch_resp[o+0] = cmd;
+        batch_resp[o+1] = rn;
+        o += 2 + rn;
+        i += 2 + n;
+        ran++;
+    }
+
+    batch_resp[0] = cstbase_batch_report_id;
+    batch_resp[1] = 'B';
+    batch_resp[3] = ran;
+    batch_resp[2] = seq;  // ready
+}
+
+// sendStatus() -- answer GET_REPORT of report ID 5 with a snapshot of
+// everything the host would otherwise need several queries for
+//
+// status_buf[] is 17 bytes long
+//  byte0  = report-id 5
+//  byte1  = PORTA, buttons on RA3,RA4,RA5 (low = pressed)
+//  byte2  = last byte from watch
+//  byte3  = bytes from watch waiting in rxRing
+//  byte4  = bytes from watch lost, as in 'r'
+//  byte5  = flags: bit0 watch docked, bit1 battery charged, bit2 5V out
+//  byte6,7 = version major, minor
+//  byte8..11  = seconds since power up, little-endian
+//  byte12,13  = commands & batches received, little-endian
+//  byte14 = commands lost to a full queue
+//  byte15 = events lost to a full queue
+//  byte16 = bytes waiting to go to watch
+//
+// Runs in USB context, straight from the GET_REPORT, so no SET_REPORT
+// or waiting for the main loop is needed.
+//
+void sendStatus(void)
+{
+    status_buf[0]  = cstbase_status_report_id;
+    status_buf[1]  = PORTA;
+    status_buf[2]  = lastRxByte;
+    status_buf[3]  = (uint8_t)(rxHead - rxTail) & (RX_RING_SIZE-1);
+    status_buf[4]  = rxOverflow;
+    status_buf[5]  = (docked ? 0x01 : 0) | (batteryCharged ? 0x02 : 0) |
+                     (PORTCbits.RC2 ? 0x04 : 0);
+    status_buf[6]  = cstbase_ver_major;
+    status_buf[7]  = cstbase_ver_minor;
+    status_buf[8]  = uptimeSecs;
+    status_buf[9]  = uptimeSecs >> 8;
+    status_buf[10] = uptimeSecs >> 16;
+    status_buf[11] = uptimeSecs >> 24;
+    status_buf[12] = cmdsReceived;
+    status_buf[13] = cmdsReceived >> 8;
+    status_buf[14] = cmdsDropped;
+    status_buf[15] = eventsDropped;
+    status_buf[16] = uart_txDepth();
+    USBEP0SendRAMPtr((BYTE*) & status_buf, sizeof(status_buf), USB_EP0_NO_OPTIONS);
 }
 
 // ------------------- utility functions -----------------------------------
@@ -786,6 +1208,7 @@ void USBCBInitEP(void)
     //USBEnableEndpoint(HID_EP, USB_HANDSHAKE_ENABLED | USB_DISALLOW_SETUP);
     //Re-arm the OUT endpoint for the next packet
     //USBOutHandle = HIDRxPacket(HID_EP, (BYTE*) & ReceivedDataBuffer, USB_EP0_BUFF_SIZE);
+    eventHandle = 0;
     usbHasBeenSetup++;
 }
 
@@ -983,13 +1406,30 @@ BOOL USER_USB_CALLBACK_EVENT_HANDLER(int event, void *pdata, WORD size)
 
 //Secondary callback function that gets called when the below
 //control transfer completes for the USBHIDCBSetReportHandler()
+//Just queues the command, main loop runs it
+//UserSetReportHandler() made sure there's room, the check is only a guard
 void USBHIDCBSetReportComplete(void)
 {
-    handleMessage((uint8_t*)&CtrlTrfData);
+    uint8_t next = (cmdHead + 1) & (CMD_QUEUE_SIZE-1);
+    if( next == cmdTail ) {
+        cmdsDropped++;
+        return;
+    }
+    memcpy( cmdQueue[cmdHead], (const void*)CtrlTrfData, USB_EP0_BUFF_SIZE );
+    cmdHead = next;
+    cmdsReceived++;
     //memcpy( msgbuf, &CtrlTrfData, sizeof(msgbuf));
     //handleMessage();
 }
 
+//Secondary callback function for report ID 2 SET_REPORTs
+//main loop runs it
+void USBHIDCBSetBatchComplete(void)
+{
+    batchPending = 1;
+    cmdsReceived++;
+}
+
 /********************************************************************
  * Function:        void USBHIDCBSetReportHandler(void)
  * PreCondition:    None
@@ -1013,7 +1453,23 @@ void UserSetReportHandler(void)
 	//Prepare to receive the command data through a SET_REPORT
 	//control transfer on endpoint 0. 
 	//USBEP0Receive((BYTE*)&CtrlTrfData, USB_EP0_BUFF_SIZE, USBHIDCBSetReportComplete);
+    deferred = DEFER_NONE;  // any earlier one was given up on
+    // report ID 2 is a batch, bigger than CtrlTrfData
+    if( SetupPkt.W_Value.byte.LB == cstbase_batch_report_id ) {
+        WORD len = SetupPkt.wLength;
+        if( len > sizeof(batch_buf) ) len = sizeof(batch_buf);
+        USBEP0Receive((BYTE*)batch_buf, len, USBHIDCBSetBatchComplete);
+        if( batchPending ) {  // don't overwrite it, wait for runCommands()
+            USBDeferOUTDataStage();
+            deferred = DEFER_BATCH_SET;
+        }
+        return;
+    }
     USBEP0Receive((BYTE*)CtrlTrfData,SetupPkt.wLength, USBHIDCBSetReportComplete);
+    if( ((cmdHead + 1) & (CMD_QUEUE_SIZE-1)) == cmdTail ) {  // queue full
+        USBDeferOUTDataStage();
+        deferred = DEFER_CMD;
+    }
 }
 
 
@@ -1041,6 +1497,24 @@ void UserSetReportHandler(void)
  *******************************************************************/
 void UserGetReportHandler(void)
 {
+    deferred = DEFER_NONE;  // any earlier one was given up on
+    if( SetupPkt.W_Value.byte.LB == cstbase_batch_report_id ) {
+        USBEP0SendRAMPtr((BYTE*) & batch_resp, sizeof(batch_resp), USB_EP0_NO_OPTIONS);
+        if( batchPending ) {  // handleBatch() hasn't finished batch_resp
+            USBDeferINDataStage();
+            deferred = DEFER_BATCH_GET;
+        }
+        return;
+    }
+    if( SetupPkt.W_Value.byte.LB == cstbase_resp_report_id ) {
+        resp_table[0] = cstbase_resp_report_id;
+        USBEP0SendRAMPtr((BYTE*) & resp_table, sizeof(resp_table), USB_EP0_NO_OPTIONS);
+        return;
+    }
+    if( SetupPkt.W_Value.byte.LB == cstbase_status_report_id ) {
+        sendStatus();
+        return;
+    }
     USBEP0SendRAMPtr((BYTE*) & hid_send_buf, USB_EP0_BUFF_SIZE, USB_EP0_NO_OPTIONS);
 }
 
@@ -5,9 +5,20 @@
 #define UART_BAUD_RATE 2048
 #endif
 
+// bytes for the watch wait here, TXIF interrupt sends them. see uart_txService()
+#define TX_RING_SIZE 32  // power of 2
+uint8_t txRing[TX_RING_SIZE];
+volatile uint8_t txHead;      // next free slot
+volatile uint8_t txTail;      // next to send
+uint8_t txMaxDepth;           // most bytes ever waiting
+volatile uint8_t txOverflow;  // counts bytes dropped on a full ring
+
+#define uart_txDepth() ((uint8_t)(txHead - txTail) & (TX_RING_SIZE-1))
+
 
 // Set up UART         2048 baud is what the watch can do with the clock crystal timer only.
 // Note, must also put "if( RCIE && RCIF ) { ... }" in interrupt function to catch received bytes
+// and call uart_txService() there to send
 void uart_init()
 {
     BRGH=0;	      // No Divider
@@ -25,6 +36,7 @@ void uart_init()
 #endif
 
     //Set Up Transmitter
+    TXIE=0;       // until there's something to send
     TXEN=1;
     SYNC=0;
     SPEN=1;
@@ -36,11 +48,36 @@ void uart_init()
 
 
 
-// put a char or byte
+// call from interrupt function: send next byte when transmitter wants one
+void uart_txService()
+{
+    if( TXIE && TXIF ) {
+        TXREG = txRing[txTail];
+        txTail = (txTail + 1) & (TX_RING_SIZE-1);
+        if( txTail == txHead ) TXIE = 0;  // all sent
+    }
+}
+
+// put a char or byte. USB commands run from runCommands() in the main loop,
+// which waits for room. only a caller in interrupt context, where nothing
+// would make room, gets the drop branch: the byte is dropped & counted
 void uart_putc(unsigned char data)
 {
-    while(!TRMT);  // wait for empty
-    TXREG = data;
+    uint8_t inIsr = !GIE;
+    if( !inIsr ) {
+        while( ((txHead + 1) & (TX_RING_SIZE-1)) == txTail );  // wait for room
+        GIE = 0;
+    }
+    uint8_t next = (txHead + 1) & (TX_RING_SIZE-1);
+    if( next == txTail ) {
+        txOverflow++;
+    } else {
+        txRing[txHead] = data;
+        txHead = next;
+        if( uart_txDepth() > txMaxDepth ) txMaxDepth = uart_txDepth();
+        TXIE = 1;
+    }
+    if( !inIsr ) GIE = 1;
     timeOutCounter=0; //because it takes time on the watch side to process, and it can time out
 }
 
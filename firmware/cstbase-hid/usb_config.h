@@ -188,8 +188,7 @@
 #define HID_INT_OUT_EP_SIZE     8
 #define HID_INT_IN_EP_SIZE      8  // was 3
 #define HID_NUM_OF_DSC          1
-#define HID_RPT01_SIZE          24
-//#define HID_RPT01_SIZE          28
+#define HID_RPT01_SIZE          59  // report IDs 1 (8 bytes), 2 (64), 3 (7), 4 (64), 5 (16)
 
 #define USER_GET_REPORT_HANDLER UserGetReportHandler
 #define USER_SET_REPORT_HANDLER UserSetReportHandler
@@ -282,8 +282,11 @@ ROM struct{BYTE report[HID_RPT01_SIZE];}hid_rpt01={
 };                  
 */
 
-/*
 //Class specific descriptor - HID
+// report ID 1 is single commands, report ID 2 is batches of them,
+// report ID 3 is events pushed on the interrupt IN endpoint,
+// report ID 4 is the table of recent answers to report ID 1 queries,
+// report ID 5 is a status snapshot
 ROM struct{BYTE report[HID_RPT01_SIZE];}hid_rpt01={
 {
     0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
@@ -303,24 +306,21 @@ ROM struct{BYTE report[HID_RPT01_SIZE];}hid_rpt01={
     0x09, 0x00,                    //   USAGE (Undefined)
     0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
 
-    0xc0                           // END_COLLECTION
-}
-};
-*/
+    0x85, 0x03,                    //   REPORT_ID (3)
+    0x95, 7,                       //   REPORT_COUNT (7)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
 
-//Class specific descriptor - HID
-ROM struct{BYTE report[HID_RPT01_SIZE];}hid_rpt01={
-{
-    0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
-    0x09, 0x01,                    // USAGE (Vendor Usage 1)
-    0xa1, 0x01,                    // COLLECTION (Application)
-    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
-    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x85, 0x01,                    //   REPORT_ID (1)
-    0x95, 8,                       //   REPORT_COUNT (8)
+    0x85, 0x04,                    //   REPORT_ID (4)
+    0x95, 64,                      //   REPORT_COUNT (64)
     0x09, 0x00,                    //   USAGE (Undefined)
     0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+    0x85, 0x05,                    //   REPORT_ID (5)
+    0x95, 16,                      //   REPORT_COUNT (16)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
     0xc0                           // END_COLLECTION
 }
 };
@@ -0,0 +1,908 @@
+/*
+ * cstbase-bench.c -- measure cstbase-lib call costs against a CST Base Station
+ *
+ * 2014, Tod E. Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ *
+ * Time open->command->close cycles, without and with a persistent context:
+ * ./cstbase-bench --openclose -n 100
+ *
+ * Compare query throughput over all devices, blocking vs asynchronous API:
+ * ./cstbase-bench --async -n 1000
+ *
+ * Query latency and control transfers per query, 
+ * old fixed-sleep way vs readiness polling:
+ * ./cstbase-bench --latency -n 100
+ *
+ * Hammer all devices with mixed commands from many threads, check results:
+ * ./cstbase-bench --stress -t 16 -n 1000
+ *
+ * Several commands as single calls vs one report ID 2 batch:
+ * ./cstbase-bench --batch -n 100
+ *
+ * Time to scan for devices, hid_enumerate() vs reading Linux sysfs:
+ * ./cstbase-bench --enumerate -n 100
+ *
+ * Four queries one after another vs pipelined through report ID 4:
+ * ./cstbase-bench --pipeline -n 100
+ *
+ * Latency percentiles of the common calls & sustained commands/sec,
+ * as JSON to keep for comparing library versions & backends:
+ * ./cstbase-bench --suite -n 1000 --json --label v1.1-hidraw > v1.1-hidraw.json
+ *
+ * Per-command latency of running cstbase-tool vs going through cstbased:
+ * ./cstbased &
+ * ./cstbase-bench-client --exec -n 100
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>    // vararg stuff
+#include <string.h>    // for memset(), strcmp(), et al
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>    // for getopt_long()
+#include <time.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "cstbase-lib.h"
+
+int iterations = 100;
+uint32_t deviceId = 0;
+int numThreads = 8;
+char* toolPath = "./cstbase-tool";
+int jsonOut = 0;
+char* label = "";
+
+int verbose;
+
+
+// ---------------------------------------------------------------------------
+
+//
+static void usage(char *myName)
+{
+    fprintf(stderr,
+"Usage: \n"
+"  %s <cmd> [options]\n"
+"where <cmd> is one of:\n"
+"  --openclose                 Time open->getVersion->close cycles,\n"
+"                              without and with cstbase_init() context\n"
+"  --async                     Query throughput over all devices,\n"
+"                              blocking calls vs async requests\n"
+"  --latency                   getButtons latency, fixed 50ms sleep\n"
+"                              vs polling for response readiness\n"
+"  --stress                    Mixed commands on all devices from many\n"
+"                              threads at once, checking the results\n"
+"  --batch                     Four commands as single calls vs one batch\n"
+"  --pipeline                  Four queries one at a time vs pipelined\n"
+"  --enumerate                 cstbase_enumerate() time, hid_enumerate()\n"
+"                              opening each device vs reading sysfs (Linux)\n"
+"  --exec                      getButtons latency, running cstbase-tool\n"
+"                              per command vs a library call\n"
+"  --suite                     p50/p99/max latency of enumerate, open,\n"
+"                              setTime, getButtons, getVersion &\n"
+"                              sendBytesToWatch (a 0 byte), and sustained\n"
+"                              getButtons/sec on one & all devices\n"
+"and [options] are: \n"
+"  -n num  --iterations num    Number of iterations per test (default 100)\n"
+"  -d id   --id id             Use this cstbase id (from cstbase-tool --list)\n"
+"  -t num  --threads num       Number of threads for --stress (default 8)\n"
+"  -T path --tool path         cstbase-tool for --exec (default %s)\n"
+"  -j      --json              Print --suite results as JSON\n"
+"  -L str  --label str         Name the --suite run, e.g. library version\n"
+"  -v, --verbose               verbose debugging msgs\n"
+"\n"
+            ,myName, toolPath);
+}
+
+// local states for the "cmd" option variable
+enum {
+    CMD_NONE = 0,
+    CMD_OPENCLOSE,
+    CMD_ASYNC,
+    CMD_LATENCY,
+    CMD_STRESS,
+    CMD_EXEC,
+    CMD_BATCH,
+    CMD_PIPELINE,
+    CMD_SUITE,
+    CMD_ENUMERATE,
+};
+
+// which cstbase-lib backend we're built on, for --suite results
+#if defined(USE_CSTBASED)
+#define BENCH_BACKEND "cstbased"
+#elif defined(USE_SIM)
+#define BENCH_BACKEND "sim"
+#elif defined(USE_HIDDATA)
+#define BENCH_BACKEND "hiddata"
+#elif defined(HIDAPI_LIBUSB)
+#define BENCH_BACKEND "hidapi-libusb"
+#elif defined(__linux__)
+#define BENCH_BACKEND "hidapi-hidraw"
+#elif defined(__APPLE__)
+#define BENCH_BACKEND "hidapi-mac"
+#elif defined(_WIN32)
+#define BENCH_BACKEND "hidapi-windows"
+#else
+#define BENCH_BACKEND "hidapi"
+#endif
+
+// monotonic time in microseconds
+static double now_micros(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000.0) + (ts.tv_nsec / 1000.0);
+#endif
+}
+
+// do "iterations" open->getVersion->close cycles, return avg micros per cycle
+static double bench_openclose(void)
+{
+    int errs = 0;
+    double start = now_micros();
+    for( int i=0; i< iterations; i++ ) {
+        cstbase_device* dev = cstbase_openById( deviceId );
+        if( dev == NULL ) {
+            errs++;
+            continue;
+        }
+        if( cstbase_getVersion(dev) == -1 ) errs++;
+        cstbase_close(dev);
+    }
+    double elapsed = now_micros() - start;
+    if( errs ) fprintf(stderr, "%d errors during openclose\n", errs);
+    return elapsed / iterations;
+}
+
+// do "iterations" scans, return avg micros per scan
+static double bench_enumerate(int* count)
+{
+    double start = now_micros();
+    for( int i=0; i< iterations; i++ ) {
+        *count = cstbase_enumerate();
+    }
+    return (now_micros() - start) / iterations;
+}
+
+// latency stats for one way of doing a query
+typedef struct bench_lat_ {
+    double min, max, total;
+    int errs;
+    uint32_t sets, gets;  // control transfers it took
+} bench_lat;
+
+//
+static void bench_lat_add( bench_lat* lat, double micros, 
+                           cstbase_xfer_stats* before )
+{
+    cstbase_xfer_stats after;
+    cstbase_getTransferStats( &after );
+    lat->sets += after.sets - before->sets;
+    lat->gets += after.gets - before->gets;
+    if( lat->total == 0 || micros < lat->min ) lat->min = micros;
+    if( micros > lat->max ) lat->max = micros;
+    lat->total += micros;
+}
+
+//
+static void bench_lat_printTimes( const char* name, bench_lat* lat )
+{
+    printf("  %-14s avg %8.1f  min %8.1f  max %8.1f usec", name, 
+           lat->total/iterations, lat->min, lat->max);
+    if( lat->errs ) printf("  (%d errors)", lat->errs);
+    printf("\n");
+}
+
+//
+static void bench_lat_print( const char* name, bench_lat* lat )
+{
+    bench_lat_printTimes( name, lat );
+    printf("  %-14s %.1f SET + %.1f GET per call\n", "", 
+           (double)lat->sets/iterations, (double)lat->gets/iterations);
+}
+
+// getButtons the way it used to be done: SET, sleep 50ms, GET
+static int bench_getButtonsSleep( cstbase_device* dev )
+{
+    uint8_t buf[cstbase_buf_size] = {cstbase_report_id, 'b' };
+    int rc = cstbase_write(dev, buf, sizeof(buf));
+    cstbase_sleep( 50 );
+    if( rc != -1 ) 
+        rc = cstbase_read(dev, buf, sizeof(buf));
+    return rc;
+}
+
+//
+static void bench_latency(void)
+{
+    bench_lat sleeplat = {0}, polllat = {0};
+
+    cstbase_init();
+    cstbase_device* dev = cstbase_openById( deviceId );
+    if( dev == NULL ) { 
+        fprintf(stderr, "could not open device %d\n", deviceId);
+        exit(1);
+    }
+    cstbase_xfer_stats before;
+    for( int i=0; i< iterations; i++ ) {
+        cstbase_getTransferStats( &before );
+        double start = now_micros();
+        if( bench_getButtonsSleep( dev ) == -1 ) sleeplat.errs++;
+        bench_lat_add( &sleeplat, now_micros() - start, &before );
+
+        cstbase_getTransferStats( &before );
+        start = now_micros();
+        if( cstbase_getButtons( dev ) == -1 ) polllat.errs++;
+        bench_lat_add( &polllat, now_micros() - start, &before );
+    }
+    cstbase_shutdown();
+
+    printf("getButtons latency, %d iterations:\n", iterations);
+    bench_lat_print( "fixed sleep:", &sleeplat );
+    bench_lat_print( "ready polling:", &polllat );
+}
+
+// setTime, getButtons, getByteFromWatch & getVersion as four calls 
+// vs one batch
+static void bench_batch(void)
+{
+    bench_lat singlelat = {0}, batchlat = {0};
+    cstbase_batch batch;
+
+    cstbase_batch_init( &batch );
+    cstbase_batch_setTime( &batch );
+    cstbase_batch_getButtons( &batch );
+    cstbase_batch_getByteFromWatch( &batch );
+    cstbase_batch_getVersion( &batch );
+
+    cstbase_init();
+    cstbase_device* dev = cstbase_openById( deviceId );
+    if( dev == NULL ) { 
+        fprintf(stderr, "could not open device %d\n", deviceId);
+        exit(1);
+    }
+    cstbase_xfer_stats before;
+    for( int i=0; i< iterations; i++ ) {
+        cstbase_getTransferStats( &before );
+        double start = now_micros();
+        if( cstbase_setTime( dev ) == -1 ||
+            cstbase_getButtons( dev ) == -1 ||
+            cstbase_getByteFromWatch( dev ) == -1 ||
+            cstbase_getVersion( dev ) == -1 ) singlelat.errs++;
+        bench_lat_add( &singlelat, now_micros() - start, &before );
+
+        cstbase_getTransferStats( &before );
+        start = now_micros();
+        if( cstbase_batch_run( dev, &batch ) != batch.count ) batchlat.errs++;
+        bench_lat_add( &batchlat, now_micros() - start, &before );
+    }
+    cstbase_shutdown();
+
+    printf("setTime+getButtons+getByteFromWatch+getVersion, %d iterations:\n",
+           iterations);
+    bench_lat_print( "single calls:", &singlelat );
+    bench_lat_print( "batch:", &batchlat );
+}
+
+// getButtons, getByteFromWatch, getVersion, getButtons one after another
+// vs all four in flight at once, checking both get the same answers
+static void bench_pipeline(void)
+{
+    bench_lat seriallat = {0}, pipelat = {0};
+    const uint8_t cmds[] = { 'b', 'R', 'v', 'b' };
+    int expect[4], results[4];
+
+    cstbase_init();
+    cstbase_device* dev = cstbase_openById( deviceId );
+    if( dev == NULL ) { 
+        fprintf(stderr, "could not open device %d\n", deviceId);
+        exit(1);
+    }
+    cstbase_xfer_stats before;
+    for( int i=0; i< iterations; i++ ) {
+        cstbase_getTransferStats( &before );
+        double start = now_micros();
+        expect[0] = cstbase_getButtons( dev );
+        expect[1] = cstbase_getByteFromWatch( dev );
+        expect[2] = cstbase_getVersion( dev );
+        expect[3] = cstbase_getButtons( dev );
+        bench_lat_add( &seriallat, now_micros() - start, &before );
+        for( int j=0; j< 4; j++ ) if( expect[j] == -1 ) seriallat.errs++;
+
+        cstbase_getTransferStats( &before );
+        start = now_micros();
+        if( cstbase_queryPipelined( dev, cmds, results, 4 ) != 4 ) pipelat.errs++;
+        bench_lat_add( &pipelat, now_micros() - start, &before );
+        for( int j=0; j< 4; j++ ) {
+            if( results[j] != expect[j] ) {
+                if( verbose ) printf("query '%c': %d, expected %d\n",
+                                     cmds[j], results[j], expect[j]);
+                pipelat.errs++;
+            }
+        }
+    }
+    cstbase_shutdown();
+
+    printf("getButtons+getByteFromWatch+getVersion+getButtons, %d iterations:\n",
+           iterations);
+    bench_lat_print( "one at a time:", &seriallat );
+    bench_lat_print( "pipelined:", &pipelat );
+}
+
+// getButtons by running cstbase-tool each time, the way scripts do it,
+// vs a library call. in the client build ("make client") the library call
+// goes through cstbased
+static void bench_exec(void)
+{
+    bench_lat execlat = {0}, liblat = {0};
+    char cmdline[1024];
+    snprintf( cmdline, sizeof(cmdline), "%s -q --id %d --buttons > /dev/null", 
+              toolPath, deviceId );
+
+    cstbase_init();
+    cstbase_device* dev = cstbase_openById( deviceId );
+    if( dev == NULL ) { 
+        fprintf(stderr, "could not open device %d\n", deviceId);
+        exit(1);
+    }
+    cstbase_xfer_stats before;
+    for( int i=0; i< iterations; i++ ) {
+        cstbase_getTransferStats( &before );
+        double start = now_micros();
+        if( system( cmdline ) != 0 ) execlat.errs++;
+        bench_lat_add( &execlat, now_micros() - start, &before );
+
+        cstbase_getTransferStats( &before );
+        start = now_micros();
+        if( cstbase_getButtons( dev ) == -1 ) liblat.errs++;
+        bench_lat_add( &liblat, now_micros() - start, &before );
+    }
+    cstbase_shutdown();
+
+    printf("getButtons per command, %d iterations:\n", iterations);
+    printf("  exec: %s\n", cmdline);
+    bench_lat_printTimes( "exec tool:", &execlat );
+#ifdef USE_CSTBASED
+    bench_lat_printTimes( "via cstbased:", &liblat );
+#else
+    bench_lat_printTimes( "library call:", &liblat );
+#endif
+}
+
+// every latency of one call, for percentiles
+typedef struct bench_hist_ {
+    const char* name;
+    double* samples;
+    int n;
+    int errs;
+} bench_hist;
+
+//
+static void bench_hist_add( bench_hist* h, double micros, int rc )
+{
+    if( rc == -1 ) h->errs++;
+    h->samples[h->n++] = micros;
+}
+
+//
+static int cmp_double( const void* a, const void* b )
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile, samples must be sorted
+static double bench_hist_pct( bench_hist* h, double pct )
+{
+    if( h->n == 0 ) return 0;
+    int i = (int)(pct/100 * h->n + 0.999999) - 1;
+    if( i < 0 ) i = 0;
+    return h->samples[i];
+}
+
+// per-device loop for the all-devices throughput part of --suite
+typedef struct suite_thread_ {
+    pthread_t thread;
+    cstbase_device** devs;
+    int first, count, stride;  // devices it takes turns on
+    int ops, errs;
+} suite_thread;
+
+//
+static void* suite_worker( void* arg )
+{
+    suite_thread* st = arg;
+    for( int i=0; i< iterations; i++ ) {
+        for( int j=st->first; j< st->count; j += st->stride ) {
+            if( cstbase_getButtons( st->devs[j] ) == -1 ) st->errs++;
+            st->ops++;
+        }
+    }
+    return NULL;
+}
+
+// wait until the base station has sent everything queued for the watch,
+// so a full TX ring isn't charged to the calls timed next. gives up after 
+// 5s, or right away without getUartStats() (firmware older than 1.6)
+static void bench_drainTx( cstbase_device* dev )
+{
+    cstbase_uart_stats stats;
+    for( int i=0; i< 500; i++ ) {
+        if( cstbase_getUartStats( dev, &stats ) == -1 ) return;
+        if( stats.tx_depth == 0 ) return;
+        cstbase_sleep( 10 );
+    }
+}
+
+// latency of each call "iterations" times, then commands/sec. 
+// open is timed without a context, like a run of cstbase-tool does it
+static int bench_suite(void)
+{
+    enum { H_ENUM, H_OPEN, H_SETTIME, H_BUTTONS, H_VERSION, H_SEND, H_COUNT };
+    bench_hist hists[H_COUNT] = {
+        { "enumerate" }, { "open" }, { "setTime" }, { "getButtons" },
+        { "getVersion" }, { "sendBytesToWatch" },
+    };
+    for( int h=0; h< H_COUNT; h++ ) 
+        hists[h].samples = calloc( iterations, sizeof(double) );
+
+    double start;
+    for( int i=0; i< iterations; i++ ) {
+        start = now_micros();
+        int n = cstbase_enumerate();
+        bench_hist_add( &hists[H_ENUM], now_micros() - start, n ? 0 : -1 );
+
+        start = now_micros();
+        cstbase_device* dev = cstbase_openById( deviceId );
+        bench_hist_add( &hists[H_OPEN], now_micros() - start, dev ? 0 : -1 );
+        if( dev ) cstbase_close( dev );
+    }
+
+    cstbase_init();
+    cstbase_device* dev = cstbase_openById( deviceId );
+    if( dev == NULL ) { 
+        fprintf(stderr, "could not open device %d\n", deviceId);
+        exit(1);
+    }
+    int version = cstbase_getVersion( dev );
+    uint8_t byte = 0;
+    // each call in its own loop, queries with the TX ring empty
+    bench_drainTx( dev );
+    for( int i=0; i< iterations; i++ ) {
+        start = now_micros();
+        int rc = cstbase_getButtons( dev );
+        bench_hist_add( &hists[H_BUTTONS], now_micros() - start, rc );
+    }
+    for( int i=0; i< iterations; i++ ) {
+        start = now_micros();
+        int rc = cstbase_getVersion( dev );
+        bench_hist_add( &hists[H_VERSION], now_micros() - start, rc );
+    }
+    for( int i=0; i< iterations; i++ ) {
+        start = now_micros();
+        int rc = cstbase_setTime( dev );
+        bench_hist_add( &hists[H_SETTIME], now_micros() - start, rc );
+    }
+    bench_drainTx( dev );
+    for( int i=0; i< iterations; i++ ) {
+        start = now_micros();
+        int rc = cstbase_sendBytesToWatch( dev, &byte, 1 );
+        bench_hist_add( &hists[H_SEND], now_micros() - start, rc );
+    }
+
+    // sustained, one device back to back
+    bench_drainTx( dev );
+    int errs = 0;
+    start = now_micros();
+    for( int i=0; i< iterations; i++ ) {
+        if( cstbase_getButtons( dev ) == -1 ) errs++;
+    }
+    double single = iterations / ((now_micros() - start)/1000000);
+
+    // sustained, all devices from numThreads threads
+    int count = cstbase_getCachedCount();
+    cstbase_device** devs = calloc( count ? count : 1, sizeof(cstbase_device*) );
+    int ndevs = 0;
+    for( int i=0; i< count; i++ ) {
+        if( !cstbase_isCachedPresent(i) ) continue;
+        devs[ndevs] = cstbase_openById( i );
+        if( devs[ndevs] ) ndevs++;
+    }
+    for( int i=0; i< ndevs; i++ ) bench_drainTx( devs[i] );
+    int nthreads = (numThreads < ndevs) ? numThreads : ndevs;
+    suite_thread* threads = calloc( nthreads ? nthreads : 1, sizeof(suite_thread) );
+    int ops = 0;
+    start = now_micros();
+    for( int i=0; i< nthreads; i++ ) {
+        threads[i].devs   = devs;
+        threads[i].first  = i;
+        threads[i].count  = ndevs;
+        threads[i].stride = nthreads;
+        pthread_create( &threads[i].thread, NULL, suite_worker, &threads[i] );
+    }
+    for( int i=0; i< nthreads; i++ ) {
+        pthread_join( threads[i].thread, NULL );
+        ops  += threads[i].ops;
+        errs += threads[i].errs;
+    }
+    double all = ops / ((now_micros() - start)/1000000);
+    cstbase_shutdown();
+
+    for( int h=0; h< H_COUNT; h++ ) {
+        qsort( hists[h].samples, hists[h].n, sizeof(double), cmp_double );
+        errs += hists[h].errs;
+    }
+
+    if( jsonOut ) {
+        printf("{\n");
+        printf("  \"label\": \"%s\",\n", label);
+        printf("  \"backend\": \"%s\",\n", BENCH_BACKEND);
+        printf("  \"firmware\": %d,\n", version);
+        printf("  \"devices\": %d,\n", ndevs);
+        printf("  \"iterations\": %d,\n", iterations);
+        printf("  \"latency_usec\": {\n");
+        for( int h=0; h< H_COUNT; h++ ) {
+            bench_hist* hi = &hists[h];
+            printf("    \"%s\": { \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f,"
+                   " \"errors\": %d }%s\n", hi->name, bench_hist_pct(hi, 50),
+                   bench_hist_pct(hi, 99), bench_hist_pct(hi, 100), hi->errs,
+                   (h < H_COUNT-1) ? "," : "");
+        }
+        printf("  },\n");
+        printf("  \"commands_per_sec\": { \"one_device\": %.1f,"
+               " \"all_devices\": %.1f, \"threads\": %d },\n",
+               single, all, nthreads);
+        printf("  \"errors\": %d\n", errs);
+        printf("}\n");
+    }
+    else {
+        printf("%s backend, fw %d, %d devices, %d iterations:\n", 
+               BENCH_BACKEND, version, ndevs, iterations);
+        for( int h=0; h< H_COUNT; h++ ) {
+            bench_hist* hi = &hists[h];
+            printf("  %-18s p50 %8.1f  p99 %8.1f  max %8.1f usec", hi->name,
+                   bench_hist_pct(hi, 50), bench_hist_pct(hi, 99),
+                   bench_hist_pct(hi, 100));
+            if( hi->errs ) printf("  (%d errors)", hi->errs);
+            printf("\n");
+        }
+        printf("  getButtons/sec: %10.1f one device, %10.1f all devices "
+               "(%d threads)\n", single, all, nthreads);
+    }
+
+    for( int h=0; h< H_COUNT; h++ ) free( hists[h].samples );
+    free( threads );
+    free( devs );
+    return errs ? 1 : 0;
+}
+
+// what each device should answer, read before the stress test starts
+typedef struct stress_dev_ {
+    cstbase_device* dev;
+    char serial[serialstrmax];
+    int version;
+} stress_dev;
+
+// one per stress thread
+typedef struct stress_thread_ {
+    pthread_t thread;
+    uint32_t rand;     // xorshift state
+    int ops, errs, bad;
+} stress_thread;
+
+static stress_dev* stressDevs;
+static int stressCount;
+
+//
+static uint32_t stress_rand( uint32_t* x )
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+// random command on a random device, check the answer makes sense
+static void* stress_worker( void* arg )
+{
+    stress_thread* st = arg;
+    for( int i=0; i< iterations; i++ ) {
+        stress_dev* sd = &stressDevs[ stress_rand(&st->rand) % stressCount ];
+        int rc = 0, ok = 1;
+        switch( stress_rand(&st->rand) % 6 ) {
+        case 0:
+            rc = cstbase_getVersion( sd->dev );
+            ok = (rc == sd->version);
+            break;
+        case 1:
+            rc = cstbase_getButtons( sd->dev );
+            ok = (rc >= 0 && rc <= 7);
+            break;
+        case 2:
+            rc = cstbase_getByteFromWatch( sd->dev );
+            ok = (rc >= 0 && rc <= 255);
+            break;
+        case 3:
+            rc = cstbase_setTime( sd->dev );
+            break;
+        case 4: { // registry lookups must agree with each other
+            int i = cstbase_getCacheIndexByDev( sd->dev );
+            const char* serial = cstbase_getSerialForDev( sd->dev );
+            ok = (i >= 0 && serial && strcmp( serial, sd->serial ) == 0 &&
+                  cstbase_getCacheIndexBySerial( sd->serial ) == i);
+            break;
+        }
+        case 5: // rescan now & then, pooled devices must survive it
+            if( stress_rand(&st->rand) % 50 == 0 ) 
+                ok = (cstbase_enumerate() >= stressCount);
+            break;
+        }
+        st->ops++;
+        if( rc == -1 ) st->errs++;
+        else if( !ok ) st->bad++;
+    }
+    return NULL;
+}
+
+//
+static int bench_stress(void)
+{
+    int errs = 0, bad = 0, ops = 0;
+#ifndef CSTBASE_THREADSAFE
+    fprintf(stderr, "warning: cstbase-lib built without THREADSAFE\n");
+#endif
+    cstbase_init();
+    int count = cstbase_getCachedCount();
+    stressDevs = calloc( count, sizeof(stress_dev) );
+    for( int i=0; i< count; i++ ) {
+        if( !cstbase_isCachedPresent(i) ) continue;
+        stress_dev* sd = &stressDevs[stressCount];
+        sd->dev = cstbase_openById( i );
+        if( sd->dev == NULL ) {
+            fprintf(stderr, "could not open device %d\n", i);
+            exit(1);
+        }
+        strcpy( sd->serial, cstbase_getCachedSerial(i) );
+        sd->version = cstbase_getVersion( sd->dev );
+        stressCount++;
+    }
+
+    stress_thread* threads = calloc( numThreads, sizeof(stress_thread) );
+    double start = now_micros();
+    for( int i=0; i< numThreads; i++ ) {
+        threads[i].rand = 2463534242u + i*7919;
+        pthread_create( &threads[i].thread, NULL, stress_worker, &threads[i] );
+    }
+    for( int i=0; i< numThreads; i++ ) {
+        pthread_join( threads[i].thread, NULL );
+        ops  += threads[i].ops;
+        errs += threads[i].errs;
+        bad  += threads[i].bad;
+    }
+    double elapsed = now_micros() - start;
+    cstbase_shutdown();
+
+    printf("%d mixed ops, %d threads, %d devices:\n", ops, numThreads, stressCount);
+    printf("  %10.1f ops/sec\n", ops / (elapsed/1000000));
+    printf("  %d transfer errors, %d bad results\n", errs, bad);
+    free( threads );
+    free( stressDevs );
+    return (errs || bad) ? 1 : 0;
+}
+
+// per-device state for the async throughput test
+typedef struct bench_dev_ {
+    cstbase_request req;
+    int remaining;   // queries left to submit
+    int errs;
+} bench_dev;
+
+static int asyncCompleted;
+
+// resubmit on the same device until it has done its share
+static void bench_async_cb(cstbase_request* req)
+{
+    bench_dev* bd = req->userdata;
+    asyncCompleted++;
+    if( req->rc == -1 ) bd->errs++;
+    if( --bd->remaining > 0 ) {
+        if( cstbase_submitQuery( req->dev, req, 'R', bench_async_cb, bd ) == -1 ) {
+            bd->errs++;
+            asyncCompleted += bd->remaining;
+            bd->remaining = 0;
+        }
+    }
+}
+
+// "iterations" queries per device, one device at a time with blocking calls,
+// then all at once with async requests. prints queries/sec for each
+static void bench_async(void)
+{
+    int count = cstbase_getCachedCount();
+    cstbase_device** devs = calloc( count, sizeof(cstbase_device*) );
+    bench_dev* bdevs = calloc( count, sizeof(bench_dev) );
+    int errs = 0;
+
+    cstbase_init();
+    for( int i=0; i< count; i++ ) {
+        devs[i] = cstbase_openById( i );
+        if( devs[i] == NULL ) {
+            fprintf(stderr, "could not open device %d\n", i);
+            exit(1);
+        }
+    }
+    int total = count * iterations;
+
+    double start = now_micros();
+    for( int i=0; i< count; i++ ) {
+        for( int j=0; j< iterations; j++ ) {
+            if( cstbase_getByteFromWatch( devs[i] ) == -1 ) errs++;
+        }
+    }
+    double blocking = now_micros() - start;
+
+    asyncCompleted = 0;
+    start = now_micros();
+    for( int i=0; i< count; i++ ) {
+        bdevs[i].remaining = iterations;
+        bdevs[i].errs = 0;
+        if( cstbase_submitQuery( devs[i], &bdevs[i].req, 'R', 
+                                 bench_async_cb, &bdevs[i] ) == -1 ) {
+            bdevs[i].errs++;
+            asyncCompleted += iterations;
+        }
+    }
+    while( asyncCompleted < total ) {
+        if( cstbase_handleEvents( 100 ) == -1 ) break;
+    }
+    double async = now_micros() - start;
+    for( int i=0; i< count; i++ ) errs += bdevs[i].errs;
+
+    cstbase_shutdown();
+    free( devs );
+    free( bdevs );
+
+    if( errs ) fprintf(stderr, "%d errors during async\n", errs);
+    printf("%d queries over %d devices:\n", total, count);
+    printf("  blocking:     %10.1f queries/sec\n", total / (blocking/1000000));
+    printf("  async:        %10.1f queries/sec\n", total / (async/1000000));
+}
+
+//
+int main(int argc, char** argv)
+{
+    static int cmd  = CMD_NONE;
+
+    // parse options
+    int option_index = 0, opt;
+    char* opt_str = "vhjn:d:t:T:L:";
+    static struct option loptions[] = {
+        {"verbose",    optional_argument, 0,      'v'},
+        {"iterations", required_argument, 0,      'n'},
+        {"id",         required_argument, 0,      'd'},
+        {"threads",    required_argument, 0,      't'},
+        {"tool",       required_argument, 0,      'T'},
+        {"json",       no_argument,       0,      'j'},
+        {"label",      required_argument, 0,      'L'},
+        {"help",       no_argument,       0,      'h'},
+        {"openclose",  no_argument,       &cmd,   CMD_OPENCLOSE },
+        {"async",      no_argument,       &cmd,   CMD_ASYNC },
+        {"latency",    no_argument,       &cmd,   CMD_LATENCY },
+        {"stress",     no_argument,       &cmd,   CMD_STRESS },
+        {"exec",       no_argument,       &cmd,   CMD_EXEC },
+        {"batch",      no_argument,       &cmd,   CMD_BATCH },
+        {"pipeline",   no_argument,       &cmd,   CMD_PIPELINE },
+        {"suite",      no_argument,       &cmd,   CMD_SUITE },
+        {"enumerate",  no_argument,       &cmd,   CMD_ENUMERATE },
+        {NULL,         0,                 0,      0}
+    };
+    while(1) {
+        opt = getopt_long(argc, argv, opt_str, loptions, &option_index);
+        if (opt==-1) break; // parsed all the args
+        switch (opt) {
+        case 0:             // deal with long opts that have no short opts
+            break;
+        case 'n':
+            iterations = strtol(optarg,NULL,10);
+            if( iterations < 1 ) iterations = 1;
+            break;
+        case 'd':
+            deviceId = strtol(optarg,NULL,0);
+            break;
+        case 't':
+            numThreads = strtol(optarg,NULL,10);
+            if( numThreads < 1 ) numThreads = 1;
+            break;
+        case 'T':
+            toolPath = optarg;
+            break;
+        case 'j':
+            jsonOut = 1;
+            break;
+        case 'L':
+            label = optarg;
+            break;
+        case 'v':
+            if( optarg==NULL ) verbose++;
+            else verbose = strtol(optarg,NULL,0);
+            break;
+        case 'h':
+            usage( "cstbase-bench" );
+            exit(1);
+            break;
+        }
+    }
+
+    if( cmd == CMD_NONE ) {
+        usage( "cstbase-bench" );
+        exit(1);
+    }
+
+    if( cstbase_enumerate() == 0 ) {
+        fprintf(stderr, "no CST Base devices found\n");
+        exit(1);
+    }
+
+    if( cmd == CMD_OPENCLOSE ) {
+        double before = bench_openclose();
+        cstbase_init();
+        double after  = bench_openclose();
+        cstbase_shutdown();
+        printf("open->getVersion->close, %d iterations:\n", iterations);
+        printf("  no context:   %10.1f usec/cycle\n", before);
+        printf("  cstbase_init: %10.1f usec/cycle\n", after);
+    }
+    else if( cmd == CMD_ASYNC ) {
+        bench_async();
+    }
+    else if( cmd == CMD_LATENCY ) {
+        bench_latency();
+    }
+    else if( cmd == CMD_STRESS ) {
+        return bench_stress();
+    }
+    else if( cmd == CMD_EXEC ) {
+        bench_exec();
+    }
+    else if( cmd == CMD_BATCH ) {
+        bench_batch();
+    }
+    else if( cmd == CMD_PIPELINE ) {
+        bench_pipeline();
+    }
+    else if( cmd == CMD_SUITE ) {
+        return bench_suite();
+    }
+    else if( cmd == CMD_ENUMERATE ) {
+        int count;
+#if defined(HIDAPI_LIBUSB) && defined(__linux__)
+        // only the libusb build has both ways, see cstbase_enumerateSysfs()
+        setenv( "CSTBASE_ENUM_LIBUSB", "1", 1 );
+        double slow = bench_enumerate( &count );
+        unsetenv( "CSTBASE_ENUM_LIBUSB" );
+        double fast = bench_enumerate( &count );
+        printf("cstbase_enumerate, %d devices, %d iterations:\n", count, iterations);
+        printf("  hid_enumerate: %10.1f usec/scan\n", slow);
+        printf("  sysfs:         %10.1f usec/scan\n", fast);
+#else
+        double t = bench_enumerate( &count );
+        printf("cstbase_enumerate, %d devices, %d iterations:\n", count, iterations);
+        printf("  enumerate:     %10.1f usec/scan\n", t);
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,324 @@
+
+// client build: calls go to cstbased over its Unix socket instead of to USB
+// cstbased does the USB transfers, we mirror its registry so ids match
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+
+#include "cstbased-proto.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0   // Mac OS X, uses SO_NOSIGPIPE instead
+#endif
+
+// the transfers of a query happen in cstbased, see cstbase_transact()
+#define CSTBASE_TRANSACT_LOWLEVEL 1
+
+struct cstbased_device_ {
+    int fd;   // own connection, so cstbased can run devices in parallel
+    int evfd; // and one for waiting on events, opened on first use
+    int id;   // cstbased's id for it
+};
+
+static int cstbased_ctlfd = -1;  // for enumerate & open, under OPEN_LOCK
+
+// connect to cstbased, returns fd or -1 if it's not running
+static int cstbased_connect(void)
+{
+    const char* path = getenv("CSTBASED_SOCKET");
+    if( path == NULL ) path = cstbased_socket_path;
+
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, path, sizeof(addr.sun_path)-1 );
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 ) return -1;
+    if( connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ) {
+        LOG("cstbased_connect: %s: %s\n", path, strerror(errno));
+        close( fd );
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on) );
+#endif
+    return fd;
+}
+
+// send or receive exactly len bytes
+static int cstbased_io( int fd, void* buf, int len, int sending )
+{
+    uint8_t* p = buf;
+    while( len > 0 ) {
+        ssize_t n = sending ? send( fd, p, len, MSG_NOSIGNAL )
+                            : recv( fd, p, len, 0 );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// one request/response round trip, response payload copied to out
+// hdr holds the request going in, the response coming out
+// returns 0, or -1 if the connection broke
+static int cstbased_roundtrip( int fd, cstbased_hdr* hdr, const void* in,
+                               void* out, int outlen )
+{
+    uint8_t payload[cstbased_payload_max];
+    int inlen = hdr->len;
+
+    if( fd < 0 ) return -1;
+    if( cstbased_io( fd, hdr, sizeof(*hdr), 1 ) == -1 ) return -1;
+    if( inlen && cstbased_io( fd, (void*)in, inlen, 1 ) == -1 ) return -1;
+    if( cstbased_io( fd, hdr, sizeof(*hdr), 0 ) == -1 ) return -1;
+    if( hdr->magic != cstbased_magic || hdr->len > sizeof(payload) ) return -1;
+    if( hdr->len && cstbased_io( fd, payload, hdr->len, 0 ) == -1 ) return -1;
+    if( out ) memcpy( out, payload, (hdr->len < outlen) ? hdr->len : outlen );
+    return 0;
+}
+
+// returns response rc, -1 if that's an error or the connection broke
+static int cstbased_request( int fd, uint8_t op, int32_t arg,
+                             const void* in, int inlen, void* out, int outlen )
+{
+    cstbased_hdr hdr = { cstbased_magic, op, inlen, arg };
+    if( cstbased_roundtrip( fd, &hdr, in, out, outlen ) == -1 ) return -1;
+    return hdr.arg;
+}
+
+// request on the control connection, reconnecting if needed
+// caller holds OPEN_LOCK
+static int cstbased_ctlRequest( uint8_t op, int32_t arg, void* out, int outlen )
+{
+    cstbased_hdr hdr = { cstbased_magic, op, 0, arg };
+    if( cstbased_ctlfd < 0 ) cstbased_ctlfd = cstbased_connect();
+    if( cstbased_roundtrip( cstbased_ctlfd, &hdr, NULL, out, outlen ) == -1 ) {
+        if( cstbased_ctlfd >= 0 ) close( cstbased_ctlfd );
+        cstbased_ctlfd = -1;  // maybe cstbased restarted, retry next time
+        return -1;
+    }
+    return hdr.arg;
+}
+
+//
+static int cstbase_initUSB(void)
+{
+    OPEN_LOCK();
+    if( cstbased_ctlfd < 0 ) cstbased_ctlfd = cstbased_connect();
+    int rc = (cstbased_ctlfd < 0) ? -1 : 0;
+    OPEN_UNLOCK();
+    return rc;
+}
+
+//
+static void cstbase_exitUSB(void)
+{
+    OPEN_LOCK();
+    if( cstbased_ctlfd >= 0 ) close( cstbased_ctlfd );
+    cstbased_ctlfd = -1;
+    OPEN_UNLOCK();
+}
+
+//
+static void cstbase_closeHandle(cstbase_device* dev)
+{
+    close( dev->fd );
+    if( dev->evfd >= 0 ) close( dev->evfd );
+    free( dev );
+}
+
+//
+int cstbase_enumerate(void)
+{
+    return cstbase_enumerateByVidPid( cstbase_vid(), cstbase_pid() );
+}
+
+// mirror cstbased's registry, in id order so our ids are the same as its
+// vid & pid are cstbased's business
+int cstbase_enumerateByVidPid(int vid, int pid)
+{
+    int p = 0;
+    OPEN_LOCK();
+    int count = cstbased_ctlRequest( CSTBASED_OP_ENUMERATE, 0, NULL, 0 );
+    cstbased_info* infos = calloc( (count > 0) ? count : 1, sizeof(cstbased_info) );
+    for( int i=0; i< count && infos; i++ ) {
+        if( cstbased_ctlRequest( CSTBASED_OP_INFO, i, &infos[i],
+                                 sizeof(cstbased_info) ) == -1 ) {
+            count = i;
+        }
+        infos[i].serial[sizeof(infos[i].serial)-1] = '\0';
+        infos[i].path[sizeof(infos[i].path)-1] = '\0';
+    }
+
+    REGISTRY_WRLOCK();
+    cstbase_registryMarkUnseen();
+    for( int i=0; i< count && infos; i++ ) {
+        int j = cstbase_findBySerialnum( strtoul( infos[i].serial, NULL, 16 ) );
+        if( infos[i].present ) {
+            cstbase_registryAdd( infos[i].serial, infos[i].path );
+            p++;
+        }
+        else if( j < 0 ) {  // never seen it, but keep its id slot
+            j = cstbase_registryAdd( infos[i].serial, infos[i].path );
+            cstbase_registryRemove( j );
+        }
+    }
+    cstbase_registryDropUnseen();
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+    free( infos );
+
+    return p;
+}
+
+// ids & serial numbers mean the same to cstbased as to us, so pass it on
+cstbase_device* cstbase_openById( uint32_t i )
+{
+    OPEN_LOCK();
+    cstbase_device* handle = NULL;
+    int id = cstbased_ctlRequest( CSTBASED_OP_OPEN, i, NULL, 0 );
+    if( id >= 0 ) {
+        handle = cstbase_getPooledDev( id );
+        if( handle == NULL ) {
+            handle = calloc( 1, sizeof(cstbase_device) );
+            if( handle ) {
+                handle->id = id;
+                handle->evfd = -1;
+                handle->fd = cstbased_connect();
+                if( handle->fd < 0 ) {
+                    free( handle );
+                    handle = NULL;
+                }
+            }
+            if( handle ) cstbase_setCachedDev( id, handle );
+        }
+    }
+    OPEN_UNLOCK();
+    return handle;
+}
+
+//
+cstbase_device* cstbase_openByPath(const char* path)
+{
+    if( path == NULL || strlen(path) == 0 ) return NULL;
+    int i = cstbase_getCacheIndexByPath( path );
+    if( i < 0 ) return NULL;
+    return cstbase_openById( i );
+}
+
+//
+cstbase_device* cstbase_openBySerial(const char* serial)
+{
+    if( serial == NULL || strlen(serial) == 0 ) return NULL;
+    return cstbase_openById( strtoul( serial, NULL, 16 ) );
+}
+
+//
+cstbase_device* cstbase_open(void)
+{
+    if( !cstbase_context.inited || cstbase_getCachedCount() == 0 )
+        cstbase_enumerate();
+
+    return cstbase_openById( 0 );
+}
+
+// one SET_REPORT, done by cstbased. caller holds device lock
+static int cstbase_writeLowlevel( cstbase_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    ATOMIC_INC( cstbase_xfers.sets );
+    return cstbased_request( dev->fd, CSTBASED_OP_WRITE, dev->id,
+                             buf, len, NULL, 0 );
+}
+
+// GET_REPORT only, buf[0] must hold report id, caller holds device lock
+static int cstbase_readLowlevel( cstbase_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    ATOMIC_INC( cstbase_xfers.gets );
+    return cstbased_request( dev->fd, CSTBASED_OP_READ, dev->id,
+                             buf, len, buf, len );
+}
+
+// cstbased waits for the input report, on the event connection so
+// other calls on dev can go ahead meanwhile
+static int cstbase_readInputLowlevel( cstbase_device* dev, void* buf, int len,
+                                      int timeout_millis )
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    cstbase_devlock* lock = cstbase_lockDev( dev );
+    if( dev->evfd < 0 ) dev->evfd = cstbased_connect();
+    cstbase_unlockDev( lock );
+
+    int32_t timeout = timeout_millis;
+    return cstbased_request( dev->evfd, CSTBASED_OP_READINPUT, dev->id,
+                             &timeout, sizeof(timeout), buf, len );
+}
+
+// whole query in one round trip, cstbased polls for the response
+static int cstbase_transactLowlevel( cstbase_device* dev, uint8_t* req,
+                                     uint8_t* resp, int len )
+{
+    cstbase_devlock* lock = cstbase_lockDev( dev );
+    int rc = cstbased_request( dev->fd, CSTBASED_OP_TRANSACT, dev->id,
+                               req, req ? len : 0, resp, len );
+    cstbase_unlockDev( lock );
+    return rc;
+}
+
+// no async requests to cstbased yet, so these complete inside submit,
+// cstbase_handleEvents() runs the callbacks
+//
+static int cstbase_writeAsync( cstbase_device* dev, void* buf, int len,
+                               cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    int rc = cstbase_writeLowlevel( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+}
+
+// GET_REPORT only, buf[0] must hold report id
+static int cstbase_readAsync( cstbase_device* dev, void* buf, int len,
+                              cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    int rc = cstbase_readLowlevel( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+}
+
+// no events, just wait for the next poll that's due
+static int cstbase_handleEventsLowlevel( int timeout_millis, int* completed )
+{
+    if( timeout_millis > 0 ) cstbase_sleep( timeout_millis );
+    return 0;
+}
+
+// cstbased follows hotplug itself, clients re-enumerate to see changes
+static int cstbase_hotplugStartLowlevel(void)
+{
+    return -1;
+}
+
+//
+static void cstbase_hotplugStopLowlevel(void)
+{
+}
+
+//
+char *cstbase_error_msg(int errCode)
+{
+    return NULL;
+}
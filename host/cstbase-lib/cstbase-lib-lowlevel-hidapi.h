@@ -1,6 +1,38 @@
 
 #include "hidapi.h"
 
+#if defined(HIDAPI_LIBUSB)
+// async transfers complete from hid_handle_events(), not inside submit
+#define CSTBASE_ASYNC_LOWLEVEL 1
+// hotplug events call cstbase_hotplugUpdate()
+#define CSTBASE_HOTPLUG_LOWLEVEL 1
+static void cstbase_hotplugUpdate( int arrived, const char* path, 
+                                   const char* serial );
+#endif
+
+//
+static int cstbase_initUSB(void)
+{
+#if defined(HIDAPI_LIBUSB)
+    // most use is feature reports, start input report polling on first read
+    hid_set_lazy_read( 1 );
+    // watch bytes come as one event each, queue about 1s of them at 2048 baud
+    hid_set_input_queue_depth( 256 );
+#endif
+    return hid_init();
+}
+
+//
+static void cstbase_exitUSB(void)
+{
+    hid_exit();
+}
+
+//
+static void cstbase_closeHandle(cstbase_device* dev)
+{
+    hid_close(dev);
+}
 
 //
 int cstbase_enumerate(void)
@@ -8,32 +40,158 @@ int cstbase_enumerate(void)
     return cstbase_enumerateByVidPid( cstbase_vid(), cstbase_pid() );
 }
 
-// get all matching devices by VID/PID pair
-int cstbase_enumerateByVidPid(int vid, int pid)
+#if defined(HIDAPI_LIBUSB) && defined(__linux__)
+#include <dirent.h>
+
+// Linux keeps every USB device's descriptors & strings in sysfs, read once
+// when it was plugged in. finding our devices there takes no USB transfers,
+// where hid_enumerate() opens each one & asks it for its serial number.
+// set CSTBASE_ENUM_LIBUSB in the environment to use hid_enumerate() anyway
+#ifndef CSTBASE_SYSFS_USB
+#define CSTBASE_SYSFS_USB "/sys/bus/usb/devices"
+#endif
+
+// one attribute of a USB device or interface, without the newline
+static int cstbase_sysfsRead( const char* dir, const char* attr, 
+                              char* buf, int len )
+{
+    char path[300];
+    snprintf( path, sizeof(path), CSTBASE_SYSFS_USB "/%s/%s", dir, attr );
+    FILE* fp = fopen( path, "r" );
+    if( fp == NULL ) return -1;
+    int ok = ( fgets( buf, len, fp ) != NULL );
+    fclose( fp );
+    if( !ok ) return -1;
+    buf[ strcspn( buf, "\n" ) ] = '\0';
+    return 0;
+}
+
+// HID interfaces of vid/pid devices, with paths made like hid_enumerate()
+// makes them so hid_open_path() takes them. 
+// returns count, -1 if there's no sysfs to read
+static int cstbase_enumerateSysfs( int vid, int pid, cstbase_info** foundp )
+{
+    DIR* dir = opendir( CSTBASE_SYSFS_USB );
+    if( dir == NULL ) return -1;
+
+    int n = 0, max = 8;
+    cstbase_info* found = calloc( max, sizeof(cstbase_info) );
+    struct dirent* ent;
+    char dev[256], buf[64];
+    while( found && (ent = readdir(dir)) != NULL ) {
+        // interfaces are named "<device>:<config>.<interface>"
+        char* colon = strchr( ent->d_name, ':' );
+        if( colon == NULL ) continue;
+        if( cstbase_sysfsRead( ent->d_name, "bInterfaceClass", buf, sizeof(buf) ) ||
+            strtol( buf, NULL, 16 ) != 0x03 ) continue;  // not HID
+        if( cstbase_sysfsRead( ent->d_name, "bInterfaceNumber", buf, sizeof(buf) ) )
+            continue;
+        int intf = strtol( buf, NULL, 16 );
+
+        snprintf( dev, sizeof(dev), "%.*s", (int)(colon - ent->d_name), ent->d_name );
+        if( cstbase_sysfsRead( dev, "idVendor", buf, sizeof(buf) ) ||
+            strtol( buf, NULL, 16 ) != vid ) continue;
+        if( cstbase_sysfsRead( dev, "idProduct", buf, sizeof(buf) ) ||
+            strtol( buf, NULL, 16 ) != pid ) continue;
+        if( cstbase_sysfsRead( dev, "busnum", buf, sizeof(buf) ) ) continue;
+        int busnum = strtol( buf, NULL, 10 );
+        if( cstbase_sysfsRead( dev, "devnum", buf, sizeof(buf) ) ) continue;
+        int devnum = strtol( buf, NULL, 10 );
+        if( cstbase_sysfsRead( dev, "serial", buf, sizeof(buf) ) ) continue;
+
+        if( n == max ) {
+            max *= 2;
+            cstbase_info* more = realloc( found, max * sizeof(cstbase_info) );
+            if( more == NULL ) break;
+            found = more;
+        }
+        memset( &found[n], 0, sizeof(cstbase_info) );
+        snprintf( found[n].path, pathstrmax, "%04x:%04x:%02x", 
+                  busnum, devnum, intf );
+        strncpy( found[n].serial, buf, serialstrmax-1 );
+        n++;
+    }
+    closedir( dir );
+    if( found == NULL ) return -1;
+    *foundp = found;
+    return n;
+}
+#endif
+
+// matching devices from hid_enumerate(), returns count, -1 on error
+static int cstbase_enumerateHidapi( int vid, int pid, cstbase_info** foundp )
 {
     struct hid_device_info *devs, *cur_dev;
 
-    int p = 0; 
+    int n = 0;
     devs = hid_enumerate(vid, pid);
+    for( cur_dev = devs; cur_dev; cur_dev = cur_dev->next ) n++;
+    cstbase_info* found = calloc( n ? n : 1, sizeof(cstbase_info) );
+    if( found == NULL ) { 
+        hid_free_enumeration(devs);
+        return -1;
+    }
+
+    int p = 0; 
     cur_dev = devs;    
     while (cur_dev) {
         if( (cur_dev->vendor_id != 0 && cur_dev->product_id != 0) &&  
             (cur_dev->vendor_id == vid && cur_dev->product_id == pid) ) { 
             if( cur_dev->serial_number != NULL ) { // can happen if not root
-                strcpy( cstbase_infos[p].path,   cur_dev->path );
-                sprintf( cstbase_infos[p].serial, "%ls", cur_dev->serial_number);
-                uint32_t serialnum = strtol( cstbase_infos[p].serial, NULL, 16);
-                cstbase_infos[p].type = 1;  // just one version currently
+                strncpy( found[p].path, cur_dev->path, pathstrmax-1 );
+                snprintf( found[p].serial, serialstrmax, "%ls", cur_dev->serial_number);
                 p++;
             }
         }
         cur_dev = cur_dev->next;
     }
     hid_free_enumeration(devs);
-    
-    cstbase_cached_count = p;
+    *foundp = found;
+    return p;
+}
+
+// qsort comparison function, for putting newly found devices in serial order
+static int cmp_cstbase_info_serial(const void *a, const void *b) 
+{ 
+    cstbase_info* bia = (cstbase_info*) a;
+    cstbase_info* bib = (cstbase_info*) b;
+
+    return strncmp( bia->serial, 
+                    bib->serial, 
+                    serialstrmax);
+} 
 
-    cstbase_sortCache();
+// get all matching devices by VID/PID pair
+// devices seen before keep their ids, new ones get the next ids in serial order
+int cstbase_enumerateByVidPid(int vid, int pid)
+{
+    // cache already follows hotplug events, nothing to scan
+    if( cstbase_context.hotplug && vid == cstbase_vid() && pid == cstbase_pid())
+        return cstbase_present_count;
+
+    cstbase_info* found = NULL;
+    int p = -1;
+#if defined(HIDAPI_LIBUSB) && defined(__linux__)
+    if( getenv("CSTBASE_ENUM_LIBUSB") == NULL ) 
+        p = cstbase_enumerateSysfs( vid, pid, &found );
+#endif
+    if( p == -1 ) 
+        p = cstbase_enumerateHidapi( vid, pid, &found );
+    if( p == -1 ) 
+        return 0;
+
+    qsort( found, p, sizeof(cstbase_info), cmp_cstbase_info_serial );
+
+    OPEN_LOCK();
+    REGISTRY_WRLOCK();
+    cstbase_registryMarkUnseen();
+    for( int i=0; i< p; i++ ) { 
+        cstbase_registryAdd( found[i].serial, found[i].path );
+    }
+    cstbase_registryDropUnseen();
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+    free( found );
 
     return p;
 }
@@ -45,14 +203,22 @@ cstbase_device* cstbase_openByPath(const char* path)
 
     LOG("cstbase_openByPath %s\n", path);
 
-    cstbase_device* handle = hid_open_path( path ); 
-
+    OPEN_LOCK();
     int i = cstbase_getCacheIndexByPath( path );
+    cstbase_device* handle = cstbase_getPooledDev( i );
+    if( handle ) { 
+        OPEN_UNLOCK();
+        return handle;
+    }
+
+    handle = hid_open_path( path ); 
+
     if( i >= 0 ) {  // good
-        cstbase_infos[i].dev = handle;
+        cstbase_setCachedDev( i, handle );
     }
     else { // uh oh, not in cache, now what?
     }
+    OPEN_UNLOCK();
     
     return handle;
 }
@@ -66,6 +232,25 @@ cstbase_device* cstbase_openBySerial(const char* serial)
     
     LOG("cstbase_openBySerial %s at vid/pid %x/%x\n", serial, vid,pid);
 
+    OPEN_LOCK();
+    int i = cstbase_getCacheIndexBySerial( serial );
+    cstbase_device* handle = cstbase_getPooledDev( i );
+    if( handle ) { 
+        OPEN_UNLOCK();
+        return handle;
+    }
+
+    // enumerated already, open by path and skip hid_open()'s re-enumerate
+    if( cstbase_isCachedPresent(i) ) {
+        handle = hid_open_path( cstbase_getCachedPath(i) );
+        if( handle ) {
+            LOG("opened by cached path %s\n", cstbase_getCachedPath(i));
+            cstbase_setCachedDev( i, handle );
+            OPEN_UNLOCK();
+            return handle;
+        }
+    }
+
     wchar_t wserialstr[serialstrmax] = {L'\0'};
 #ifdef _WIN32   // omg windows you suck
     swprintf( wserialstr, serialstrmax, L"%S", serial); // convert to wchar_t*
@@ -73,17 +258,17 @@ cstbase_device* cstbase_openBySerial(const char* serial)
     swprintf( wserialstr, serialstrmax, L"%s", serial); // convert to wchar_t*
 #endif
     LOG("serialstr: '%ls' \n", wserialstr );
-    cstbase_device* handle = hid_open(vid,pid, wserialstr ); 
+    handle = hid_open(vid,pid, wserialstr ); 
     if( handle ) LOG("got a cstbase_device handle\n"); 
 
-    int i = cstbase_getCacheIndexBySerial( serial );
     if( i >= 0 ) {
         LOG("good, serial was in cache\n");
-        cstbase_infos[i].dev = handle;
+        cstbase_setCachedDev( i, handle );
     }
     else { // uh oh, not in cache, now what?
         LOG("uh oh, serial was not in cache\n");
     }
+    OPEN_UNLOCK();
 
     return handle;
 }
@@ -91,42 +276,37 @@ cstbase_device* cstbase_openBySerial(const char* serial)
 //
 cstbase_device* cstbase_openById( uint32_t i ) 
 { 
-    if( i > cstbase_max_devices ) { // then i is a serial number not an array index
+    if( i >= cstbase_getCachedCount() ) { // then i is a serial number not an id
+        int j = cstbase_getCacheIndexBySerialnum( i );
+        if( cstbase_isCachedPresent(j) ) 
+            return cstbase_openByPath( cstbase_getCachedPath(j) );
         char serialstr[serialstrmax];
         sprintf( serialstr, "%X", i);  // convert to wchar_t* 
         return cstbase_openBySerial( serialstr );  
     } 
-    else {
+    else if( cstbase_isCachedPresent(i) ) {
         return cstbase_openByPath( cstbase_getCachedPath(i) );
     }
+    return NULL;
 }
 
 //
 cstbase_device* cstbase_open(void)
 {
-    cstbase_enumerate();
+    // in a persistent context, trust the existing cache
+    if( !cstbase_context.inited || cstbase_getCachedCount() == 0 ) 
+        cstbase_enumerate();
     
     return cstbase_openById( 0 );
 }
 
-//
-// FIXME: search through cstbases list to zot it too?
-void cstbase_close( cstbase_device* dev )
-{
-    if( dev != NULL ) {
-        cstbase_clearCacheDev(dev); // FIXME: hmmm 
-        hid_close(dev);
-    }
-    dev = NULL;
-    hid_exit(); // FIXME: this cleans up libusb in a way that hid_close doesn't
-}
-
-//
-int cstbase_write( cstbase_device* dev, void* buf, int len)
+// one SET_REPORT, caller holds device lock (see cstbase_write())
+static int cstbase_writeLowlevel( cstbase_device* dev, void* buf, int len)
 {
     if( dev==NULL ) {
         return -1; // CSTBASE_ERR_NOTOPEN;
     }
+    ATOMIC_INC( cstbase_xfers.sets );
     int rc = hid_send_feature_report( dev, buf, len );
     // FIXME: put this in an ifdef?
     if( rc==-1 ) {
@@ -135,21 +315,107 @@ int cstbase_write( cstbase_device* dev, void* buf, int len)
     return rc;
 }
 
-// len should contain length of buf
-// after call, len will contain actual len of buf read
-int cstbase_read( cstbase_device* dev, void* buf, int len)
+// one input report from the interrupt endpoint, report id in buf[0]
+// waits up to timeout_millis (-1 forever), returns length, 0 on timeout
+static int cstbase_readInputLowlevel( cstbase_device* dev, void* buf, int len,
+                                      int timeout_millis )
+{
+    int rc = hid_read_timeout( dev, buf, len, timeout_millis );
+    if( rc == -1 ) {
+        LOG("cstbase_readInput: error reading input report\n");
+    }
+    return rc;
+}
+
+// GET_REPORT only, buf[0] must hold report id, caller holds device lock
+// len should contain length of buf, returns actual len read or -1
+static int cstbase_readLowlevel( cstbase_device* dev, void* buf, int len)
 {
     if( dev==NULL ) {
         return -1; // CSTBASE_ERR_NOTOPEN;
     }
-    int rc = hid_send_feature_report(dev, buf, len); // FIXME: check rc
-
-    if( (rc = hid_get_feature_report(dev, buf, len) == -1) ) {
-      LOG("error reading data: %s\n",cstbase_error_msg(rc));
+    ATOMIC_INC( cstbase_xfers.gets );
+    int rc = hid_get_feature_report(dev, buf, len);
+    if( rc == -1 ) {
+      LOG("error reading data: %ls\n", hid_error(dev));
     }
     return rc;
 }
 
+// asynchronous transfers: real ones on the libusb backend, on other 
+// backends they complete synchronously inside submit and 
+// cstbase_handleEvents() runs the callbacks
+//
+static int cstbase_writeAsync( cstbase_device* dev, void* buf, int len, 
+                               cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    ATOMIC_INC( cstbase_xfers.sets );
+#if defined(HIDAPI_LIBUSB)
+    return hid_send_feature_report_async( dev, buf, len, cb, arg );
+#else
+    int rc = hid_send_feature_report( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+#endif
+}
+
+// GET_REPORT only, buf[0] must hold report id
+static int cstbase_readAsync( cstbase_device* dev, void* buf, int len, 
+                              cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    ATOMIC_INC( cstbase_xfers.gets );
+#if defined(HIDAPI_LIBUSB)
+    return hid_get_feature_report_async( dev, buf, len, cb, arg );
+#else
+    int rc = hid_get_feature_report( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+#endif
+}
+
+//
+static int cstbase_handleEventsLowlevel( int timeout_millis, int* completed )
+{
+#if defined(HIDAPI_LIBUSB)
+    return hid_handle_events( timeout_millis, completed );
+#else
+    if( timeout_millis > 0 ) cstbase_sleep( timeout_millis ); // polls' wait
+    return 0;
+#endif
+}
+
+#if defined(HIDAPI_LIBUSB)
+//
+static void cstbase_hotplugEvent( int arrived, struct hid_device_info* info,
+                                  void* userdata )
+{
+    char serial[serialstrmax] = {'\0'};
+    if( info->serial_number != NULL ) // can happen if not root
+        snprintf( serial, sizeof(serial), "%ls", info->serial_number );
+    cstbase_hotplugUpdate( arrived, info->path, serial );
+}
+#endif
+
+// hotplug only on libusb, elsewhere callers fall back to enumerating
+static int cstbase_hotplugStartLowlevel(void)
+{
+#if defined(HIDAPI_LIBUSB)
+    return hid_hotplug_register( cstbase_vid(), cstbase_pid(), 
+                                 cstbase_hotplugEvent, NULL );
+#else
+    return -1;
+#endif
+}
+
+//
+static void cstbase_hotplugStopLowlevel(void)
+{
+#if defined(HIDAPI_LIBUSB)
+    hid_hotplug_deregister();
+#endif
+}
 
 //
 char *cstbase_error_msg(int errCode)
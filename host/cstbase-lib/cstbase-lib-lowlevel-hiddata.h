@@ -4,6 +4,23 @@
 
 static cstbase_device* static_dev;
 
+//
+static int cstbase_initUSB(void)
+{
+    return 0;  // usbhidOpenDevice() does usb_init() on first use
+}
+
+//
+static void cstbase_exitUSB(void)
+{
+}
+
+//
+static void cstbase_closeHandle(cstbase_device* dev)
+{
+    usbhidCloseDevice(dev);
+    if( dev == static_dev ) static_dev = NULL;
+}
 
 //
 char *cstbase_error_msg(int errCode)
@@ -32,11 +49,26 @@ int cstbase_enumerate(void)
 int cstbase_enumerateByVidPid(int vid, int pid)
 {
     int p = 0; 
-    if( cstbase_open() ) { 
-        cstbase_close(static_dev);
+    OPEN_LOCK();
+    if( cstbase_context.inited && static_dev ) { // already open in pool
+        p = 1;
+    }
+    else if( cstbase_open() ) { 
+        if( !cstbase_context.inited ) cstbase_close(static_dev);
         p = 1;
     }
 
+    // no serials or paths in HIDDATA builds, the one device is id 0
+    REGISTRY_WRLOCK();
+    cstbase_registryMarkUnseen();
+    if( p ) { 
+        int i = cstbase_registryAdd( "", "" );
+        if( cstbase_context.inited ) cstbase_registrySetDev( i, static_dev );
+    }
+    cstbase_registryDropUnseen();
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+
     /*
     struct hid_device_info *devs, *cur_dev;
 
@@ -62,10 +94,6 @@ int cstbase_enumerateByVidPid(int vid, int pid)
     }
     hid_free_enumeration(devs);
 */
-    
-    cstbase_cached_count = p;
-
-    cstbase_sortCache();
 
     return p;
 }
@@ -134,7 +162,7 @@ cstbase_device* cstbase_openBySerial(const char* serial)
 //
 cstbase_device* cstbase_openById( uint32_t i ) 
 { 
-    if( i > cstbase_max_devices ) { // then i is a serial number not array index
+    if( i >= cstbase_getCachedCount() ) { // then i is a serial number not id
         char serialstr[serialstrmax];
         sprintf( serialstr, "%X", i);  // convert to wchar_t* 
         return cstbase_openBySerial( serialstr );  
@@ -147,6 +175,13 @@ cstbase_device* cstbase_openById( uint32_t i )
 //
 cstbase_device* cstbase_open(void)
 {
+    // only one device in HIDDATA builds, so it's the whole pool
+    OPEN_LOCK();
+    if( cstbase_context.inited && static_dev ) { 
+        OPEN_UNLOCK();
+        return static_dev;
+    }
+
     int rc = usbhidOpenDevice( &static_dev, 
                                cstbase_vid(), NULL,
                                cstbase_pid(), NULL,
@@ -155,47 +190,95 @@ cstbase_device* cstbase_open(void)
     if( rc != USBOPEN_SUCCESS ) { 
         LOG("cannot open: \n");
     }
-    return static_dev;
-}
-
-//
-// FIXME: search through cstbases list to zot it too?
-void cstbase_close( cstbase_device* dev )
-{
-    if( dev != NULL ) {
-        cstbase_clearCacheDev(dev); // FIXME: hmmm 
-        usbhidCloseDevice(dev);
+    else if( cstbase_context.inited ) {
+        cstbase_setCachedDev( 0, static_dev );  // pool it
     }
-    dev = NULL;
-    //hid_exit();// FIXME: this cleans up libusb in a way that hid_close doesn't
+    cstbase_device* dev = static_dev;
+    OPEN_UNLOCK();
+    return dev;
 }
 
-//
-int cstbase_write( cstbase_device* dev, void* buf, int len)
+// one SET_REPORT, caller holds device lock (see cstbase_write())
+static int cstbase_writeLowlevel( cstbase_device* dev, void* buf, int len)
 {
     int rc;
     if( dev==NULL ) {
         return -1; // CSTBASE_ERR_NOTOPEN;
     }
-    if( (rc = usbhidSetReport(dev, buf, len) != 0) ){
+    ATOMIC_INC( cstbase_xfers.sets );
+    if( (rc = usbhidSetReport(dev, buf, len)) != 0 ){
         LOG( "cstbase_write error: %s\n", cstbase_error_msg(rc));
+        return -1;
     }
 
     return rc;
 }
 
+// GET_REPORT only, buf[0] must hold report id, caller holds device lock
 // len should contain length of buf
-// after call, len will contain actual len of buf read
-int cstbase_read( cstbase_device* dev, void* buf, int len)
+static int cstbase_readLowlevel( cstbase_device* dev, void* buf, int len)
 {
     if( dev==NULL ) {
         return -1; // CSTBASE_ERR_NOTOPEN;
     }
-    int rc = cstbase_write( dev, buf, len); // FIXME: check rc
-    if((rc = usbhidGetReport(dev, 1, (char*)buf, &len)) != 0) {
+    ATOMIC_INC( cstbase_xfers.gets );
+    int rc = usbhidGetReport(dev, ((uint8_t*)buf)[0], (char*)buf, &len);
+    if( rc != 0 ) {
         LOG("error reading data: %s\n", cstbase_error_msg(rc));
+        return -1;
     }
-    return rc;
+    return len;
+}
+
+// one input report from the interrupt endpoint, report id in buf[0]
+// waits up to timeout_millis (-1 forever), returns length, 0 on timeout
+static int cstbase_readInputLowlevel( cstbase_device* dev, void* buf, int len,
+                                      int timeout_millis )
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    int rc = usbhidReadInput(dev, (char*)buf, len, timeout_millis);
+    return (rc < 0) ? -1 : rc;
+}
+
+// no asynchronous transfers with libusb-0.1, so these complete 
+// synchronously inside submit, cstbase_handleEvents() runs the callbacks
+//
+static int cstbase_writeAsync( cstbase_device* dev, void* buf, int len, 
+                               cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    int rc = cstbase_writeLowlevel( dev, buf, len );
+    cb( dev, (rc==0) ? len : -1, buf, arg );
+    return 0;
 }
 
+// GET_REPORT only, buf[0] must hold report id
+static int cstbase_readAsync( cstbase_device* dev, void* buf, int len, 
+                              cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    int rc = cstbase_readLowlevel( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+}
+
+// no events, just wait for the next poll that's due
+static int cstbase_handleEventsLowlevel( int timeout_millis, int* completed )
+{
+    if( timeout_millis > 0 ) cstbase_sleep( timeout_millis );
+    return 0;
+}
+
+// no hotplug with libusb-0.1
+static int cstbase_hotplugStartLowlevel(void)
+{
+    return -1;
+}
+
+//
+static void cstbase_hotplugStopLowlevel(void)
+{
+}
 
@@ -0,0 +1,200 @@
+
+// sim build: no USB, devices are the virtual stations of cstbase-sim.c
+
+#include "cstbase-sim.h"
+
+//
+static int cstbase_initUSB(void)
+{
+    return cstsim_init();
+}
+
+//
+static void cstbase_exitUSB(void)
+{
+}
+
+// stations live as long as the process, nothing to free
+static void cstbase_closeHandle(cstbase_device* dev)
+{
+}
+
+//
+int cstbase_enumerate(void)
+{
+    return cstbase_enumerateByVidPid( cstbase_vid(), cstbase_pid() );
+}
+
+// all stations match the default VID/PID, none match any other
+int cstbase_enumerateByVidPid(int vid, int pid)
+{
+    int p = 0;
+    if( vid == cstbase_vid() && pid == cstbase_pid() ) p = cstsim_count();
+
+    // already sorted by serial
+    OPEN_LOCK();
+    REGISTRY_WRLOCK();
+    cstbase_registryMarkUnseen();
+    for( int i=0; i< p; i++ ) {
+        cstbase_registryAdd( cstsim_serial(i), cstsim_path(i) );
+    }
+    cstbase_registryDropUnseen();
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+
+    return p;
+}
+
+//
+cstbase_device* cstbase_openByPath(const char* path)
+{
+    if( path == NULL || strlen(path) == 0 ) return NULL;
+
+    LOG("cstbase_openByPath %s\n", path);
+
+    OPEN_LOCK();
+    int i = cstbase_getCacheIndexByPath( path );
+    cstbase_device* handle = cstbase_getPooledDev( i );
+    if( handle ) {
+        OPEN_UNLOCK();
+        return handle;
+    }
+
+    handle = cstsim_openPath( path );
+
+    if( i >= 0 ) {
+        cstbase_setCachedDev( i, handle );
+    }
+    OPEN_UNLOCK();
+
+    return handle;
+}
+
+//
+cstbase_device* cstbase_openBySerial(const char* serial)
+{
+    if( serial == NULL || strlen(serial) == 0 ) return NULL;
+
+    LOG("cstbase_openBySerial %s\n", serial);
+
+    OPEN_LOCK();
+    int i = cstbase_getCacheIndexBySerial( serial );
+    cstbase_device* handle = cstbase_getPooledDev( i );
+    if( handle ) {
+        OPEN_UNLOCK();
+        return handle;
+    }
+
+    handle = cstsim_openSerial( serial );
+
+    if( i >= 0 ) {
+        cstbase_setCachedDev( i, handle );
+    }
+    OPEN_UNLOCK();
+
+    return handle;
+}
+
+//
+cstbase_device* cstbase_openById( uint32_t i )
+{
+    if( i >= cstbase_getCachedCount() ) { // then i is a serial number not an id
+        int j = cstbase_getCacheIndexBySerialnum( i );
+        if( cstbase_isCachedPresent(j) )
+            return cstbase_openByPath( cstbase_getCachedPath(j) );
+        char serialstr[serialstrmax];
+        sprintf( serialstr, "%X", i);
+        return cstbase_openBySerial( serialstr );
+    }
+    else if( cstbase_isCachedPresent(i) ) {
+        return cstbase_openByPath( cstbase_getCachedPath(i) );
+    }
+    return NULL;
+}
+
+//
+cstbase_device* cstbase_open(void)
+{
+    // in a persistent context, trust the existing cache
+    if( !cstbase_context.inited || cstbase_getCachedCount() == 0 )
+        cstbase_enumerate();
+
+    return cstbase_openById( 0 );
+}
+
+// one SET_REPORT, caller holds device lock (see cstbase_write())
+static int cstbase_writeLowlevel( cstbase_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    ATOMIC_INC( cstbase_xfers.sets );
+    return cstsim_setReport( dev, buf, len );
+}
+
+// one input report, report id in buf[0]
+// waits up to timeout_millis (-1 forever), returns length, 0 on timeout
+static int cstbase_readInputLowlevel( cstbase_device* dev, void* buf, int len,
+                                      int timeout_millis )
+{
+    return cstsim_readInput( dev, buf, len, timeout_millis );
+}
+
+// GET_REPORT only, buf[0] must hold report id, caller holds device lock
+// len should contain length of buf, returns actual len read or -1
+static int cstbase_readLowlevel( cstbase_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    ATOMIC_INC( cstbase_xfers.gets );
+    return cstsim_getReport( dev, buf, len );
+}
+
+// asynchronous transfers complete synchronously inside submit,
+// cstbase_handleEvents() runs their requests' callbacks
+//
+static int cstbase_writeAsync( cstbase_device* dev, void* buf, int len,
+                               cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    ATOMIC_INC( cstbase_xfers.sets );
+    int rc = cstsim_setReport( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+}
+
+// GET_REPORT only, buf[0] must hold report id
+static int cstbase_readAsync( cstbase_device* dev, void* buf, int len,
+                              cstbase_xfer_cb cb, void* arg )
+{
+    if( dev==NULL ) return -1;
+    ATOMIC_INC( cstbase_xfers.gets );
+    int rc = cstsim_getReport( dev, buf, len );
+    cb( dev, rc, buf, arg );
+    return 0;
+}
+
+// no events, just wait for the next poll that's due
+static int cstbase_handleEventsLowlevel( int timeout_millis, int* completed )
+{
+    if( timeout_millis > 0 ) cstbase_sleep( timeout_millis );
+    return 0;
+}
+
+// stations never come or go
+static int cstbase_hotplugStartLowlevel(void)
+{
+    return -1;
+}
+
+//
+static void cstbase_hotplugStopLowlevel(void)
+{
+}
+
+//
+char *cstbase_error_msg(int errCode)
+{
+    return NULL;
+}
@@ -22,17 +22,114 @@
 
 #include "cstbase-lib.h"
 
+#ifdef CSTBASE_THREADSAFE
+#include <pthread.h>
+#endif
+
+// hash chains through the registry, one per kind of lookup
+enum { 
+    HASH_SERIAL = 0,
+    HASH_PATH,
+    HASH_DEV,
+    HASH_KINDS,
+};
+
 // cstbase copy of some hid_device_info and other bits. 
-// this seems kinda dumb, though. is there a better way?
+// index into cstbase_infos[] is the device id, which never changes
+// while the library is loaded, even across unplug & replug
 typedef struct cstbase_info_ {
     cstbase_device* dev;  // device, if opened, NULL otherwise
     char path[pathstrmax];  // platform-specific device path
     char serial[serialstrmax];
+    uint32_t serialnum;   // serial packed, like firmware's serialnum_packed
     int type;  // from cstbasetypes
+    int present;  // plugged in, as of last scan or hotplug event
+    int seen;     // found by scan in progress
+    int hnext[HASH_KINDS];  // next id in each hash chain, -1 at end
+#ifdef CSTBASE_THREADSAFE
+    pthread_mutex_t lock;   // one transfer sequence at a time on this device
+#endif
 } cstbase_info;
 
-static cstbase_info cstbase_infos[cache_max];
-static int cstbase_cached_count = 0;  // number of cached entities
+static cstbase_info** cstbase_infos;  // the registry, entries never move
+static int cstbase_infos_size = 0;    // allocated entries
+static int cstbase_cached_count = 0;  // number of ids handed out
+static int cstbase_present_count = 0; // number of those plugged in
+static int* cstbase_hash[HASH_KINDS]; // chain heads, by hash bucket
+static int cstbase_hash_size = 0;     // number of buckets, power of 2
+
+// pooled handles of unplugged devices. other threads may still be using
+// them, so they stay open (failing their transfers) until shutdown
+typedef struct cstbase_retired_ {
+    cstbase_device* dev;
+    int id;       // registry entry it was pooled in, for its lock
+    struct cstbase_retired_* next;
+} cstbase_retired;
+
+static cstbase_retired* cstbase_retired_devs;
+
+// persistent library context, see cstbase_init()
+// while inited, the USB stack stays up and opened devices stay open
+// in cstbase_infos[] (the pool, keyed by serial) across close/open calls
+typedef struct cstbase_ctx_ {
+    int inited;
+    int hotplug;       // cache is kept up to date by hotplug events
+    cstbase_hotplug_callback hotplug_cb;
+    void* hotplug_userdata;
+} cstbase_ctx;
+
+static cstbase_ctx cstbase_context;
+
+// running count of control transfers, see cstbase_getTransferStats()
+static cstbase_xfer_stats cstbase_xfers;
+
+// thread-safe builds: the registry is behind a read-mostly rwlock, 
+// opening & closing devices is serialized, and each device has a lock 
+// held for a whole transfer sequence, so different devices run in parallel.
+// lock order is open, registry, device. never take the registry lock 
+// while holding a device lock
+#ifdef CSTBASE_THREADSAFE
+typedef pthread_mutex_t cstbase_devlock;
+static pthread_rwlock_t cstbase_registryLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t  cstbase_openLock;    // recursive, see cstbase_locksInit()
+static pthread_mutex_t  cstbase_orphanLock = PTHREAD_MUTEX_INITIALIZER; 
+static pthread_once_t   cstbase_locksOnce = PTHREAD_ONCE_INIT;
+static void cstbase_locksInit(void);
+#define REGISTRY_RDLOCK() pthread_rwlock_rdlock(&cstbase_registryLock)
+#define REGISTRY_WRLOCK() pthread_rwlock_wrlock(&cstbase_registryLock)
+#define REGISTRY_UNLOCK() pthread_rwlock_unlock(&cstbase_registryLock)
+#define OPEN_LOCK()   do { pthread_once(&cstbase_locksOnce, cstbase_locksInit); \
+                           pthread_mutex_lock(&cstbase_openLock); } while(0)
+#define OPEN_UNLOCK() pthread_mutex_unlock(&cstbase_openLock)
+#define ATOMIC_INC(x) __sync_fetch_and_add(&(x), 1)
+#else
+typedef int cstbase_devlock;
+#define REGISTRY_RDLOCK() do {} while(0)
+#define REGISTRY_WRLOCK() do {} while(0)
+#define REGISTRY_UNLOCK() do {} while(0)
+#define OPEN_LOCK()       do {} while(0)
+#define OPEN_UNLOCK()     do {} while(0)
+#define ATOMIC_INC(x)     ((x)++)
+#endif
+
+static cstbase_devlock* cstbase_lockDev( cstbase_device* dev );
+static int  cstbase_trylockDev( cstbase_device* dev, cstbase_devlock** lockp );
+static void cstbase_unlockDev( cstbase_devlock* lock );
+
+static cstbase_device* cstbase_getPooledDev( int i );
+static int  cstbase_registryAdd( const char* serial, const char* path );
+static void cstbase_registryRemove( int i );
+static void cstbase_registryMarkUnseen(void);
+static void cstbase_registryDropUnseen(void);
+static void cstbase_registrySetDev( int i, cstbase_device* dev );
+static void cstbase_setCachedDev( int i, cstbase_device* dev );
+static int  cstbase_findByPath( const char* path );
+static int  cstbase_findBySerialnum( uint32_t serialnum );
+static int  cstbase_findByDev( cstbase_device* dev );
+static int  cstbase_findRetired( cstbase_device* dev );
+
+// low-level transfer completion, rc is bytes transferred or -1
+typedef void (*cstbase_xfer_cb)(cstbase_device* dev, int rc, unsigned char* buf, void* arg);
 
 
 // set in Makefile to debug HIDAPI stuff
@@ -45,20 +142,535 @@ static int cstbase_cached_count = 0;  // number of cached entities
 //----------------------------------------------------------------------------
 // implementation-varying code 
 
-#if USE_HIDAPI
+#if USE_CSTBASED
+#include "cstbase-lib-lowlevel-cstbased.h"
+#elif USE_HIDAPI
 #include "cstbase-lib-lowlevel-hidapi.h"
 #elif USE_HIDDATA
 #include "cstbase-lib-lowlevel-hiddata.h"
+#elif USE_SIM
+#include "cstbase-lib-lowlevel-sim.h"
 #else
 #error "Need to define USE_HIDAPI or USE_HIDDATA"
 #endif
 
 
+//
+int cstbase_init(void)
+{
+    if( cstbase_context.inited ) return 0;
+    int rc = cstbase_initUSB();
+    if( rc == 0 ) cstbase_context.inited = 1;
+    return rc;
+}
+
+//
+void cstbase_shutdown(void)
+{
+    if( !cstbase_context.inited ) return;
+    cstbase_hotplugStop();
+    OPEN_LOCK();
+    REGISTRY_WRLOCK();
+    for( int i=0; i< cstbase_cached_count; i++ ) { 
+        if( cstbase_infos[i]->dev != NULL ) {
+            cstbase_closeHandle( cstbase_infos[i]->dev );
+            cstbase_registrySetDev( i, NULL );
+        }
+    }
+    while( cstbase_retired_devs ) {
+        cstbase_retired* r = cstbase_retired_devs;
+        cstbase_retired_devs = r->next;
+        cstbase_closeHandle( r->dev );
+        free( r );
+    }
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+    cstbase_context.inited = 0;
+    cstbase_exitUSB();
+}
+
+// when in a persistent context, pooled devices are kept open, 
+// otherwise close device and tear down USB stack like before
+void cstbase_close( cstbase_device* dev )
+{
+    if( dev == NULL ) return;
+    if( cstbase_context.inited && cstbase_getCacheIndexByDev(dev) >= 0 ) {
+        return; // stays open in pool for next cstbase_open*()
+    }
+    if( cstbase_context.inited ) {
+        REGISTRY_RDLOCK();
+        int retired = cstbase_findRetired( dev );
+        REGISTRY_UNLOCK();
+        if( retired >= 0 ) return; // unplugged, others may have it too
+    }
+    OPEN_LOCK();
+    cstbase_clearCacheDev(dev);
+    cstbase_closeHandle(dev);
+    if( !cstbase_context.inited ) {
+        cstbase_exitUSB(); // FIXME: this cleans up libusb in a way that hid_close doesn't
+    }
+    OPEN_UNLOCK();
+}
+
+// return pooled device at cache index i, or NULL if not pooled
+static cstbase_device* cstbase_getPooledDev( int i )
+{
+    cstbase_device* dev = NULL;
+    REGISTRY_RDLOCK();
+    if( cstbase_context.inited && i >= 0 && i < cstbase_cached_count ) 
+        dev = cstbase_infos[i]->dev;
+    REGISTRY_UNLOCK();
+    return dev;
+}
+
+//----------------------------------------------------------------------------
+// device registry: cstbase_infos[] plus hash chains for lookup by packed 
+// serial, path and handle. entries are never removed, only marked absent,
+// so ids stay valid. functions in this section expect the caller to hold
+// the registry write lock
+
+//
+static uint32_t cstbase_hashStr( const char* str )
+{
+    uint32_t h = 2166136261u;  // FNV-1a
+    while( *str ) { 
+        h ^= (uint8_t)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//
+static uint32_t cstbase_hashKey( int kind, cstbase_info* info )
+{
+    switch( kind ) { 
+    case HASH_SERIAL: return info->serialnum * 2654435761u;
+    case HASH_PATH:   return cstbase_hashStr( info->path );
+    }
+    return (uint32_t)((uintptr_t)info->dev >> 4) * 2654435761u;
+}
+
+// chain head for a key
+static int* cstbase_hashHead( int kind, uint32_t key )
+{
+    return &cstbase_hash[kind][ key & (cstbase_hash_size-1) ];
+}
+
+// entries with no path or no handle aren't hashed under those
+static void cstbase_hashInsert( int kind, int i )
+{
+    cstbase_info* info = cstbase_infos[i];
+    if( kind == HASH_PATH && info->path[0] == '\0' ) return;
+    if( kind == HASH_DEV && info->dev == NULL ) return;
+    int* head = cstbase_hashHead( kind, cstbase_hashKey(kind, info) );
+    info->hnext[kind] = *head;
+    *head = i;
+}
+
+//
+static void cstbase_hashRemove( int kind, int i )
+{
+    int* link = cstbase_hashHead( kind, cstbase_hashKey(kind, cstbase_infos[i]) );
+    while( *link >= 0 ) { 
+        if( *link == i ) { 
+            *link = cstbase_infos[i]->hnext[kind];
+            return;
+        }
+        link = &cstbase_infos[ *link ]->hnext[kind];
+    }
+}
+
+// resize buckets to keep chains short, then rechain everything
+static int cstbase_rehash( int size )
+{
+    for( int k=0; k< HASH_KINDS; k++ ) { 
+        int* heads = realloc( cstbase_hash[k], size * sizeof(int) );
+        if( heads == NULL ) return -1;
+        memset( heads, 0xff, size * sizeof(int) ); // all -1
+        cstbase_hash[k] = heads;
+    }
+    cstbase_hash_size = size;
+    for( int i=0; i< cstbase_cached_count; i++ ) { 
+        for( int k=0; k< HASH_KINDS; k++ ) cstbase_hashInsert( k, i );
+    }
+    return 0;
+}
+
+// find device by serial, or give it the next id. marks it present & seen
+// returns id or -1 if out of memory
+static int cstbase_registryAdd( const char* serial, const char* path )
+{
+    int i = cstbase_findBySerialnum( strtoul( serial, NULL, 16 ) );
+    if( i < 0 ) { 
+        if( cstbase_cached_count == cstbase_infos_size ) { 
+            int size = cstbase_infos_size ? cstbase_infos_size*2 : 16;
+            cstbase_info** infos = realloc(cstbase_infos, size*sizeof(cstbase_info*));
+            if( infos == NULL ) return -1;
+            cstbase_infos = infos;
+            cstbase_infos_size = size;
+        }
+        if( cstbase_cached_count+1 > cstbase_hash_size ) { 
+            int size = cstbase_hash_size ? cstbase_hash_size*2 : 32;
+            if( cstbase_rehash( size ) == -1 ) return -1;
+        }
+        cstbase_info* info = calloc( 1, sizeof(cstbase_info) );
+        if( info == NULL ) return -1;
+#ifdef CSTBASE_THREADSAFE
+        pthread_mutex_init( &info->lock, NULL );
+#endif
+        i = cstbase_cached_count;
+        cstbase_infos[i] = info;
+        cstbase_cached_count++;
+        strncpy( info->serial, serial, serialstrmax-1 );
+        info->serialnum = strtoul( serial, NULL, 16 );
+        info->type = 1;  // just one version currently
+        cstbase_hashInsert( HASH_SERIAL, i );
+    }
+    cstbase_info* info = cstbase_infos[i];
+    if( strcmp( info->path, path ) != 0 ) { 
+        cstbase_hashRemove( HASH_PATH, i );
+        strncpy( info->path, path, pathstrmax-1 );
+        cstbase_hashInsert( HASH_PATH, i );
+    }
+    if( !info->present ) cstbase_present_count++;
+    info->present = 1;
+    info->seen = 1;
+    return i;
+}
+
+// device is gone, retire its pooled handle. id stays reserved for it
+static void cstbase_registryRemove( int i )
+{
+    cstbase_info* info = cstbase_infos[i];
+    if( !info->present ) return;
+    LOG("cstbase_registryRemove: %s gone\n", info->serial);
+    if( info->dev && cstbase_context.inited ) { 
+        // not closed here, another thread may be in a call on it
+        cstbase_retired* r = calloc( 1, sizeof(cstbase_retired) );
+        if( r ) {
+            r->dev = info->dev;
+            r->id = i;
+            r->next = cstbase_retired_devs;
+            cstbase_retired_devs = r;
+        }
+    }
+    cstbase_registrySetDev( i, NULL );
+    cstbase_hashRemove( HASH_PATH, i );
+    info->path[0] = '\0';
+    info->present = 0;
+    cstbase_present_count--;
+}
+
+// a scan starts, devices it finds are re-added...
+static void cstbase_registryMarkUnseen(void)
+{
+    for( int i=0; i< cstbase_cached_count; i++ ) cstbase_infos[i]->seen = 0;
+}
+
+// ...and when it's done the ones it didn't find are gone
+static void cstbase_registryDropUnseen(void)
+{
+    for( int i=0; i< cstbase_cached_count; i++ ) { 
+        if( !cstbase_infos[i]->seen ) cstbase_registryRemove( i );
+    }
+}
+
+//
+static void cstbase_registrySetDev( int i, cstbase_device* dev )
+{
+    if( i < 0 || i >= cstbase_cached_count ) return;
+    cstbase_hashRemove( HASH_DEV, i );
+    cstbase_infos[i]->dev = dev;
+    cstbase_hashInsert( HASH_DEV, i );
+}
+
+//
+static int cstbase_findByPath( const char* path ) 
+{
+    if( cstbase_hash_size == 0 || path == NULL ) return -1;
+    int i = *cstbase_hashHead( HASH_PATH, cstbase_hashStr(path) );
+    for( ; i >= 0; i = cstbase_infos[i]->hnext[HASH_PATH] ) { 
+        if( strcmp( cstbase_infos[i]->path, path ) == 0 ) return i;
+    }
+    return -1;
+}
+
+//
+static int cstbase_findBySerialnum( uint32_t serialnum ) 
+{
+    if( cstbase_hash_size == 0 ) return -1;
+    int i = *cstbase_hashHead( HASH_SERIAL, serialnum * 2654435761u );
+    for( ; i >= 0; i = cstbase_infos[i]->hnext[HASH_SERIAL] ) { 
+        if( cstbase_infos[i]->serialnum == serialnum ) return i;
+    }
+    return -1;
+}
+
+//
+static int cstbase_findByDev( cstbase_device* dev ) 
+{
+    if( cstbase_hash_size == 0 || dev == NULL ) return -1;
+    cstbase_info key = { .dev = dev };
+    int i = *cstbase_hashHead( HASH_DEV, cstbase_hashKey( HASH_DEV, &key ) );
+    for( ; i >= 0; i = cstbase_infos[i]->hnext[HASH_DEV] ) { 
+        if( cstbase_infos[i]->dev == dev ) return i;
+    }
+    return -1;
+}
+
+// registry entry a retired handle was pooled in, or -1
+static int cstbase_findRetired( cstbase_device* dev )
+{
+    for( cstbase_retired* r = cstbase_retired_devs; r; r = r->next ) {
+        if( r->dev == dev ) return r->id;
+    }
+    return -1;
+}
+
+// for use outside this section, takes the registry lock
+static void cstbase_setCachedDev( int i, cstbase_device* dev )
+{
+    REGISTRY_WRLOCK();
+    cstbase_registrySetDev( i, dev );
+    REGISTRY_UNLOCK();
+}
+
+//----------------------------------------------------------------------------
+// locking
+
+#ifdef CSTBASE_THREADSAFE
+//
+static void cstbase_locksInit(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &cstbase_openLock, &attr );
+    pthread_mutexattr_destroy( &attr );
+}
+
+// dev's lock. devices opened outside the registry share one lock, 
+// retired handles keep their entry's
+static cstbase_devlock* cstbase_devLock( cstbase_device* dev )
+{
+    cstbase_devlock* lock = &cstbase_orphanLock;
+    REGISTRY_RDLOCK();
+    int i = cstbase_findByDev( dev );
+    if( i < 0 ) i = cstbase_findRetired( dev );
+    if( i >= 0 ) lock = &cstbase_infos[i]->lock;  // entries never move
+    REGISTRY_UNLOCK();
+    return lock;
+}
+
+// lock dev for a transfer sequence
+static cstbase_devlock* cstbase_lockDev( cstbase_device* dev )
+{
+    cstbase_devlock* lock = cstbase_devLock( dev );
+    pthread_mutex_lock( lock );
+    return lock;
+}
+
+// like cstbase_lockDev(), but -1 instead of waiting if dev is in use
+static int cstbase_trylockDev( cstbase_device* dev, cstbase_devlock** lockp )
+{
+    *lockp = cstbase_devLock( dev );
+    return (pthread_mutex_trylock( *lockp ) == 0) ? 0 : -1;
+}
+
+//
+static void cstbase_unlockDev( cstbase_devlock* lock )
+{
+    pthread_mutex_unlock( lock );
+}
+#else
+static cstbase_devlock* cstbase_lockDev( cstbase_device* dev ) { return NULL; }
+static int cstbase_trylockDev( cstbase_device* dev, cstbase_devlock** lockp ) 
+{ 
+    *lockp = NULL;
+    return 0;
+}
+static void cstbase_unlockDev( cstbase_devlock* lock ) { }
+#endif
+
+//
+int cstbase_hotplugStart(cstbase_hotplug_callback cb, void* userdata)
+{
+    if( !cstbase_context.inited ) return -1;
+    cstbase_hotplugStop();
+    cstbase_context.hotplug_cb = cb;
+    cstbase_context.hotplug_userdata = userdata;
+    cstbase_context.hotplug = 1;
+    // hotplug start reports what's present, like a scan
+    REGISTRY_WRLOCK();
+    cstbase_registryMarkUnseen();
+    REGISTRY_UNLOCK();
+    if( cstbase_hotplugStartLowlevel() == -1 ) {
+        cstbase_context.hotplug = 0;
+        cstbase_context.hotplug_cb = NULL;
+        return -1;
+    }
+    OPEN_LOCK();
+    REGISTRY_WRLOCK();
+    cstbase_registryDropUnseen();
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+    return 0;
+}
+
+//
+void cstbase_hotplugStop(void)
+{
+    if( !cstbase_context.hotplug ) return;
+    cstbase_hotplugStopLowlevel();
+    cstbase_context.hotplug = 0;
+    cstbase_context.hotplug_cb = NULL;
+}
+
+#if defined(CSTBASE_HOTPLUG_LOWLEVEL)
+// add or remove one device in the registry from a hotplug event
+static void cstbase_hotplugUpdate( int arrived, const char* path, 
+                                   const char* serial )
+{
+    if( !cstbase_context.hotplug ) return;
+    if( serial == NULL || strlen(serial) == 0 ) return; // can't use it
+    
+    OPEN_LOCK();
+    REGISTRY_WRLOCK();
+    int i = cstbase_findBySerialnum( strtoul( serial, NULL, 16 ) );
+    if( arrived ) {
+        i = cstbase_registryAdd( serial, path );
+    }
+    else if( i >= 0 ) { 
+        cstbase_registryRemove( i );
+    }
+    REGISTRY_UNLOCK();
+    OPEN_UNLOCK();
+    if( i < 0 ) return;
+    if( cstbase_context.hotplug_cb ) 
+        cstbase_context.hotplug_cb( arrived, serial, 
+                                    cstbase_context.hotplug_userdata );
+}
+#endif
+
+
 // -------------------------------------------------------------------------
 // everything below here doesn't need to know about USB details
 // except for a "cstbase_device*"
 // -------------------------------------------------------------------------
 
+// low-level write, one transfer under the device's lock
+int cstbase_write( cstbase_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    cstbase_devlock* lock = cstbase_lockDev( dev );
+    int rc = cstbase_writeLowlevel( dev, buf, len );
+    cstbase_unlockDev( lock );
+    return rc;
+}
+
+// low-level read, GET_REPORT only
+int cstbase_read( cstbase_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // CSTBASE_ERR_NOTOPEN;
+    }
+    cstbase_devlock* lock = cstbase_lockDev( dev );
+    int rc = cstbase_readLowlevel( dev, buf, len );
+    cstbase_unlockDev( lock );
+    return rc;
+}
+
+// next query sequence number, never 0 so a cleared response can't match
+// starts somewhere different in each process, as they may share a device
+static uint8_t cstbase_nextSeq(void)
+{
+    static uint8_t seq;
+    static int seeded;
+    uint8_t s;
+    if( !seeded ) {  // a race here only costs a different start
+        seq = getpid() * 61;
+        seeded = 1;
+    }
+    while( (s = ATOMIC_INC(seq) + 1) == 0 ) ; // skip 0
+    return s;
+}
+
+// is response in buf the answer to query command 'cmd' with sequence 'seq'?
+static int cstbase_isResponseReady( uint8_t* buf, uint8_t cmd, uint8_t seq )
+{
+    return buf[1] == cmd && buf[2] == seq;
+}
+
+// length of report with given id, including report id byte
+static int cstbase_reportLen( uint8_t id )
+{
+    return (id == cstbase_batch_report_id) ? cstbase_batch_buf_size 
+                                           : cstbase_buf_size;
+}
+
+// one SET_REPORT of query, then poll with GET_REPORT until firmware echoes
+// our command & sequence byte back, backing off 1,2,4,.. millis between polls
+int cstbase_transact( cstbase_device* dev, uint8_t* req, uint8_t* resp )
+{
+    if( dev == NULL ) return -1;
+    int len = (req) ? cstbase_reportLen( req[0] ) : cstbase_buf_size;
+#if defined(CSTBASE_TRANSACT_LOWLEVEL)
+    // backend does the whole exchange at the far end, one round trip
+    return cstbase_transactLowlevel( dev, req, resp, len );
+#else
+    int xfers = 1;
+    int backoff = 0;
+
+    if( req == NULL ) {  // GET alone, whatever firmware has ready
+        resp[0] = cstbase_report_id;
+        return (cstbase_read(dev, resp, len) == -1) ? -1 : xfers;
+    }
+
+    uint8_t id  = req[0];
+    uint8_t cmd = req[1];
+    uint8_t seq = cstbase_nextSeq();
+    req[2] = seq;
+    cstbase_devlock* lock = cstbase_lockDev( dev );
+    int rc = cstbase_writeLowlevel(dev, req, len);
+    uint64_t start = cstbase_millis();
+    while( rc != -1 ) { 
+        resp[0] = id;
+        xfers++;
+        rc = cstbase_readLowlevel(dev, resp, len);
+        if( rc == -1 ) break;
+        if( cstbase_isResponseReady( resp, cmd, seq ) ) break;
+        if( cstbase_millis() - start > cstbase_query_timeout ) {
+            LOG("cstbase_transact: timeout on '%c'\n", cmd);
+            rc = -1; 
+            break;
+        }
+        if( backoff ) cstbase_sleep( backoff );
+        backoff = (backoff==0) ? 1 : (backoff < 16) ? backoff*2 : 16;
+    }
+    cstbase_unlockDev( lock );
+    return (rc == -1) ? -1 : xfers;
+#endif
+}
+
+// turn the data of command cmd's answer into what the query functions return
+static int cstbase_decodeValue( uint8_t cmd, uint8_t* data )
+{
+    switch( cmd ) {
+    case 'b': return data[0] >> 3; // shift them down to bit pos 0,1,2
+    case 'R': return data[0];
+    case 'v': return ((data[0]-'0') * 100) + (data[1]-'0');
+    }
+    return 0;
+}
+
+// turn a query response report into the value the query functions return
+static int cstbase_decodeResponse( uint8_t* buf )
+{
+    return cstbase_decodeValue( buf[1], buf+3 );
+}
+
 // set time to current localtime
 int cstbase_setTime(cstbase_device *dev)
 {
@@ -79,15 +691,11 @@ int cstbase_setTimeTo(cstbase_device *dev, uint8_t hours, uint8_t mins, uint8_t
 //
 int cstbase_getButtons(cstbase_device *dev)
 {
-    char buf[cstbase_buf_size] = {cstbase_report_id, 'b' };
-    int len = sizeof(buf);
+    uint8_t buf[cstbase_buf_size] = {cstbase_report_id, 'b' };
 
-    int rc = cstbase_write(dev, buf, sizeof(buf));
-    cstbase_sleep( 50 ); //FIXME:
+    int rc = cstbase_transact(dev, buf, buf);
     if( rc != -1 ) // no error
-        rc = cstbase_read(dev, buf, len);
-    if( rc != -1 ) // also no error
-        rc = buf[3] >> 3; // shift them down to bit pos 0,1,2
+        rc = cstbase_decodeResponse( buf );
     // rc is now button state as bitfield
     return rc;
 }
@@ -97,8 +705,8 @@ int cstbase_sendBytesToWatch(cstbase_device *dev, uint8_t* bytebuf, uint8_t len
 {
     uint8_t buf[cstbase_buf_size];
 
-    if( len > 6 ) { // error
-        LOG("cstbase_sendBytesToWatch: oops, len > 6\n");
+    if( len > cstbase_send_max ) { // error
+        LOG("cstbase_sendBytesToWatch: oops, len > %d\n", cstbase_send_max);
         return -1;
     }
 
@@ -114,40 +722,632 @@ int cstbase_sendBytesToWatch(cstbase_device *dev, uint8_t* bytebuf, uint8_t len
     return rc; 
 }
 
+// base station's TX queue to the watch holds this many bytes
+#define cstbase_tx_queue_max 31
+// a byte to the watch takes 10 bits at 2048 baud
+#define cstbase_watch_byte_micros 4883
+
+// each round trip is one batch of { 'S', n, bytes }, { 'q', 0 }, sending
+// only as many bytes as the last 'q' said there's room for, so the
+// firmware's main loop never blocks on a full queue.
+// answer is { 2, 'B', seq, count, ['S', 0,] 'q', 5, txDepth, txMaxDepth,
+//             txOverflow, rxDepth, rxOverflow }
+int cstbase_streamToWatch(cstbase_device *dev, uint8_t* buf, int len)
+{
+    uint8_t req[cstbase_batch_buf_size];
+    uint8_t resp[cstbase_batch_buf_size];
+    int room = 0;    // in TX queue, unknown until first answer
+    int sent = 0;
+    int overflow = -1, overflowNow;  // txOverflow at start & now
+
+    if( len < 0 ) return -1;
+    while( 1 ) {
+        int n = (len - sent < room) ? len - sent : room;
+        int p = 4;
+        memset( req, 0, sizeof(req) );
+        req[0] = cstbase_batch_report_id;
+        req[1] = 'B';
+        req[3] = (n > 0) ? 2 : 1;  // count
+        if( n > 0 ) {
+            req[p++] = 'S';
+            req[p++] = n;
+            memcpy( req + p, buf + sent, n );
+            p += n;
+        }
+        req[p++] = 'q';
+        req[p++] = 0;
+        if( cstbase_transact( dev, req, resp ) == -1 ) return -1;
+
+        int q = (n > 0) ? 6 : 4;  // where 'q' answer starts
+        if( resp[3] != req[3] || resp[q] != 'q' || resp[q+1] != 5 ) {
+            LOG("cstbase_streamToWatch: bad answer, old firmware?\n");
+            return -1;
+        }
+        overflowNow = resp[q+4];
+        if( overflow == -1 ) overflow = overflowNow;
+        sent += n;
+        if( sent == len ) break;
+
+        // let queue drain to half empty before sending more
+        room = cstbase_tx_queue_max - resp[q+2];
+        if( room < cstbase_tx_queue_max/2 ) {
+            int wait = cstbase_tx_queue_max/2 - room;
+            cstbase_sleep( (wait * cstbase_watch_byte_micros + 999) / 1000 );
+        }
+    }
+    // someone else's bytes filled the queue under us
+    if( overflowNow != overflow ) {
+        LOG("cstbase_streamToWatch: base station dropped bytes\n");
+        return -1;
+    }
+    return sent;
+}
+
 //
 int cstbase_getByteFromWatch(cstbase_device *dev)
 {
-    char buf[cstbase_buf_size] = {cstbase_report_id, 'R' };
-    int len = sizeof(buf);
+    uint8_t buf[cstbase_buf_size] = {cstbase_report_id, 'R' };
 
-    int rc = cstbase_write(dev, buf, sizeof(buf));
-    //cstbase_sleep( 50 ); //FIXME:
-    if( rc != -1 ) // no error
-        rc = cstbase_read(dev, buf, len);
+    int rc = cstbase_transact(dev, buf, buf);
     // rc is now last received byte, or error -1
     if( rc != -1 ) 
-        rc = buf[3];
+        rc = cstbase_decodeResponse( buf );
     return rc;
 }
 
+// one 'r' in a batch frame per round trip, as many bytes as a report holds
+// answer is { 2, 'B', seq, 1, 'r', n, overflow, bytes[n-1] }
+int cstbase_readWatchBytes(cstbase_device *dev, uint8_t* buf, int maxlen,
+                           uint8_t* overflow)
+{
+    uint8_t req[cstbase_batch_buf_size];
+    uint8_t resp[cstbase_batch_buf_size];
+    int max = cstbase_batch_buf_size - 7;  // room for bytes in the answer
+    int got = 0;
+
+    while( got < maxlen ) {
+        int want = (maxlen - got < max) ? maxlen - got : max;
+        memset( req, 0, sizeof(req) );
+        req[0] = cstbase_batch_report_id;
+        req[1] = 'B';
+        req[3] = 1;       // count
+        req[4] = 'r';
+        req[5] = 1;       // args
+        req[6] = want;
+        if( cstbase_transact( dev, req, resp ) == -1 ) return -1;
+        if( resp[3] != 1 || resp[4] != 'r' || resp[5] < 1 ||
+            resp[5] - 1 > want ) {
+            LOG("cstbase_readWatchBytes: bad answer, old firmware?\n");
+            return -1;
+        }
+        int n = resp[5] - 1;
+        if( overflow ) *overflow = resp[6];
+        memcpy( buf + got, resp + 7, n );
+        got += n;
+        if( n < want ) break;  // ring is empty
+    }
+    return got;
+}
+
 //
 int cstbase_getVersion(cstbase_device *dev)
 {
-    char buf[cstbase_buf_size] = {cstbase_report_id, 'v' };
-    int len = sizeof(buf);
+    uint8_t buf[cstbase_buf_size] = {cstbase_report_id, 'v' };
 
-    //hid_set_nonblocking(dev, 0);
-    int rc = cstbase_write(dev, buf, sizeof(buf));
-    cstbase_sleep( 50 ); //FIXME:
+    int rc = cstbase_transact(dev, buf, buf);
     if( rc != -1 ) // no error
-        rc = cstbase_read(dev, buf, len);
-    if( rc != -1 ) // also no error
-        rc = ((buf[3]-'0') * 100) + (buf[4]-'0'); 
+        rc = cstbase_decodeResponse( buf );
     // rc is now version number or error  
     // FIXME: we don't know vals of errcodes
     return rc;
 }
 
+// answer is { 1, 'q', seq, txDepth, txMaxDepth, txOverflow, rxDepth, rxOverflow }
+int cstbase_getUartStats(cstbase_device *dev, cstbase_uart_stats* stats)
+{
+    uint8_t buf[cstbase_buf_size] = {cstbase_report_id, 'q' };
+
+    if( cstbase_transact(dev, buf, buf) == -1 ) return -1;
+    stats->tx_depth    = buf[3];
+    stats->tx_max      = buf[4];
+    stats->tx_overflow = buf[5];
+    stats->rx_depth    = buf[6];
+    stats->rx_overflow = buf[7];
+    return 0;
+}
+
+// one GET_REPORT, see sendStatus() in firmware for the report format
+int cstbase_getStatus(cstbase_device *dev, cstbase_status* status)
+{
+    uint8_t buf[cstbase_status_buf_size] = {cstbase_status_report_id };
+
+    if( cstbase_read( dev, buf, sizeof(buf) ) == -1 ) return -1;
+    if( buf[0] != cstbase_status_report_id ) return -1;
+    status->buttons     = cstbase_decodeValue( 'b', buf+1 );
+    status->last_byte   = cstbase_decodeValue( 'R', buf+2 );
+    status->rx_depth    = buf[3];
+    status->rx_overflow = buf[4];
+    status->docked      = (buf[5] & 0x01) != 0;
+    status->charged     = (buf[5] & 0x02) != 0;
+    status->five_volts  = (buf[5] & 0x04) != 0;
+    status->version     = cstbase_decodeValue( 'v', buf+6 );
+    status->uptime      = buf[8] | (buf[9]<<8) | (buf[10]<<16) | ((uint32_t)buf[11]<<24);
+    status->commands    = buf[12] | (buf[13]<<8);
+    status->commands_dropped = buf[14];
+    status->events_dropped   = buf[15];
+    status->tx_depth    = buf[16];
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// pipelined queries, see handleMessage() in firmware for report ID 4
+
+//
+int cstbase_queryBegin( cstbase_device* dev, uint8_t* req )
+{
+    if( dev == NULL ) return -1;
+    req[0] = cstbase_report_id;
+    req[2] = cstbase_nextSeq();
+    if( cstbase_write( dev, req, cstbase_buf_size ) == -1 ) return -1;
+    return req[2];
+}
+
+// look for answer to req in report ID 4 table, copying it to resp if there
+static int cstbase_findAnswer( uint8_t* table, uint8_t* req, uint8_t* resp )
+{
+    for( int i=0; i< cstbase_resp_slots; i++ ) {
+        uint8_t* slot = table + 1 + (i * cstbase_report_size);
+        if( cstbase_isResponseReady( slot, req[1], req[2] ) ) {
+            memcpy( resp, slot, cstbase_report_size );
+            resp[cstbase_report_size] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// poll report ID 4 until answers to all n reqs are in, or timeout
+// done[i] set for each one answered. returns GET_REPORTs used, -1 on error
+static int cstbase_collectAnswers( cstbase_device* dev, uint8_t** reqs, 
+                                   uint8_t** resps, int* done, int n )
+{
+    uint8_t table[cstbase_resp_buf_size];
+    int gets = 0;
+    int backoff = 0;
+    int left = n;
+    uint64_t start = cstbase_millis();
+
+    while( left ) {
+        table[0] = cstbase_resp_report_id;
+        if( cstbase_read( dev, table, sizeof(table) ) == -1 ) return -1;
+        gets++;
+        for( int i=0; i< n; i++ ) {
+            if( done[i] || !cstbase_findAnswer( table, reqs[i], resps[i] ) ) 
+                continue;
+            done[i] = 1;
+            left--;
+        }
+        if( !left ) break;
+        if( cstbase_millis() - start > cstbase_query_timeout ) {
+            LOG("cstbase_collectAnswers: timeout, %d of %d missing\n", left, n);
+            return -1;
+        }
+        if( backoff ) cstbase_sleep( backoff );
+        backoff = (backoff==0) ? 1 : (backoff < 16) ? backoff*2 : 16;
+    }
+    return gets;
+}
+
+//
+int cstbase_queryEnd( cstbase_device* dev, uint8_t* req, uint8_t* resp )
+{
+    int done = 0;
+    if( dev == NULL ) return -1;
+    return cstbase_collectAnswers( dev, &req, &resp, &done, 1 );
+}
+
+// sends a window of queries, then collects them all together
+int cstbase_queryPipelined( cstbase_device* dev, const uint8_t* cmds, 
+                            int* results, int count )
+{
+    uint8_t bufs[cstbase_pipeline_max][cstbase_buf_size];
+    uint8_t* reqs[cstbase_pipeline_max];
+    int done[cstbase_pipeline_max];
+    int answered = 0;
+
+    if( dev == NULL ) return -1;
+    for( int i=0; i< count; i++ ) results[i] = -1;
+
+    for( int w=0; w< count; w += cstbase_pipeline_max ) {
+        int n = (count - w < cstbase_pipeline_max) ? count - w 
+                                                    : cstbase_pipeline_max;
+        for( int i=0; i< n; i++ ) {
+            reqs[i] = bufs[i];
+            memset( bufs[i], 0, cstbase_buf_size );
+            bufs[i][1] = cmds[w+i];
+            done[i] = 0;
+            if( cstbase_queryBegin( dev, bufs[i] ) == -1 ) return -1;
+        }
+        // answers overwrite their requests, cmd & tag stay the same
+        int rc = cstbase_collectAnswers( dev, reqs, reqs, done, n );
+        for( int i=0; i< n; i++ ) {
+            if( !done[i] ) continue;
+            results[w+i] = cstbase_decodeValue( bufs[i][1], bufs[i]+3 );
+            answered++;
+        }
+        if( rc == -1 ) break;
+    }
+    return answered;
+}
+
+//-----------------------------------------------------------------------------
+// batches, see handleBatch() in firmware for the frame format
+
+//
+void cstbase_batch_init(cstbase_batch* b)
+{
+    memset( b, 0, sizeof(*b) );
+    b->len = 4;      // id, 'B', seq, count
+    b->resplen = 4;
+}
+
+// append { cmd, len, args } if it and its answer of rlen bytes fit
+static int cstbase_batch_add( cstbase_batch* b, uint8_t cmd, 
+                              uint8_t* args, uint8_t len, uint8_t rlen )
+{
+    if( b->count == cstbase_batch_max ||
+        b->len + 2 + len > cstbase_batch_buf_size ||
+        b->resplen + 2 + rlen > cstbase_batch_buf_size ) {
+        LOG("cstbase_batch_add: batch full\n");
+        return -1;
+    }
+    b->buf[b->len++] = cmd;
+    b->buf[b->len++] = len;
+    memcpy( b->buf + b->len, args, len );
+    b->len += len;
+    b->resplen += 2 + rlen;
+    b->cmds[b->count] = cmd;
+    return b->count++;
+}
+
+//
+int cstbase_batch_setTime(cstbase_batch* b)
+{
+    uint8_t hours,mins,secs;
+    cstbase_getLocalTime( &hours, &mins, &secs );
+    return cstbase_batch_setTimeTo( b, hours, mins, secs );
+}
+
+//
+int cstbase_batch_setTimeTo(cstbase_batch* b, uint8_t hours, uint8_t mins, uint8_t secs)
+{
+    uint8_t args[3] = { hours, mins, secs };
+    return cstbase_batch_add( b, 'T', args, sizeof(args), 0 );
+}
+
+//
+int cstbase_batch_sendBytesToWatch(cstbase_batch* b, uint8_t* bytebuf, uint8_t len)
+{
+    return cstbase_batch_add( b, 'S', bytebuf, len, 0 );
+}
+
+//
+int cstbase_batch_getButtons(cstbase_batch* b)
+{
+    return cstbase_batch_add( b, 'b', NULL, 0, 1 );
+}
+
+//
+int cstbase_batch_getByteFromWatch(cstbase_batch* b)
+{
+    return cstbase_batch_add( b, 'R', NULL, 0, 1 );
+}
+
+//
+int cstbase_batch_getVersion(cstbase_batch* b)
+{
+    return cstbase_batch_add( b, 'v', NULL, 0, 2 );
+}
+
+// answer is { 2, 'B', seq, count, { cmd, n, data[n] }... }
+int cstbase_batch_run(cstbase_device* dev, cstbase_batch* b)
+{
+    uint8_t resp[cstbase_batch_buf_size];
+
+    b->buf[0] = cstbase_batch_report_id;
+    b->buf[1] = 'B';
+    b->buf[3] = b->count;
+    for( int i=0; i< b->count; i++ ) b->results[i] = -1;
+
+    if( cstbase_transact( dev, b->buf, resp ) == -1 ) return -1;
+
+    int ran = 0;
+    int p = 4;
+    while( ran < resp[3] && ran < b->count && p+2 <= sizeof(resp) ) {
+        uint8_t cmd = resp[p];
+        uint8_t n   = resp[p+1];
+        if( cmd != b->cmds[ran] || p+2+n > sizeof(resp) ) break;
+        b->results[ran++] = cstbase_decodeValue( cmd, resp+p+2 );
+        p += 2 + n;
+    }
+    return ran;
+}
+
+//-----------------------------------------------------------------------------
+// events, see sendEvents() in firmware for the report format
+
+// no device lock, input reports don't get in the way of feature reports
+int cstbase_readEvent(cstbase_device* dev, cstbase_event* ev, int timeout_millis)
+{
+    uint8_t buf[cstbase_buf_size];
+
+    if( dev == NULL ) return -1;
+    uint64_t start = cstbase_millis();
+    while( 1 ) {
+        int wait = timeout_millis;
+        if( timeout_millis > 0 ) {
+            wait = timeout_millis - (int)(cstbase_millis() - start);
+            if( wait < 0 ) wait = 0;
+        }
+        buf[0] = cstbase_event_report_id;
+        int rc = cstbase_readInputLowlevel( dev, buf, sizeof(buf), wait );
+        if( rc <= 0 ) return rc;
+        if( buf[0] == cstbase_event_report_id && rc >= 5 ) {
+            ev->type    = buf[1];
+            ev->data    = buf[2];
+            ev->seq     = buf[3];
+            ev->dropped = buf[4];
+            return 1;
+        }
+        if( wait == 0 ) return 0;  // some other input report, keep waiting
+    }
+}
+
+//-----------------------------------------------------------------------------
+// asynchronous requests
+
+// a query's SET_REPORT is sent under its device's lock, so it can't come
+// between the SET & GETs of a blocking query (the lock is only taken to 
+// submit it, transfers to a device go out in the order submitted). its 
+// answer is picked up by seq from the report ID 4 table, where blocking
+// queries' answers can't overwrite it
+
+// requests backing off before their next GET_REPORT, or waiting for 
+// their device to be free to send, run from cstbase_handleEvents() & 
+// cstbase_waitRequest()
+static cstbase_request* cstbase_pollWaiting;
+#if !defined(CSTBASE_ASYNC_LOWLEVEL)
+// transfers ran inside submit, callbacks wait here for the same two calls
+// so a callback that submits again doesn't go deeper into the stack
+static cstbase_request*  cstbase_doneWaiting;
+static cstbase_request** cstbase_doneTail = &cstbase_doneWaiting;
+#endif
+#ifdef CSTBASE_THREADSAFE
+static pthread_mutex_t cstbase_pollLock = PTHREAD_MUTEX_INITIALIZER;
+#define POLL_LOCK()   pthread_mutex_lock(&cstbase_pollLock)
+#define POLL_UNLOCK() pthread_mutex_unlock(&cstbase_pollLock)
+#else
+#define POLL_LOCK()   do {} while(0)
+#define POLL_UNLOCK() do {} while(0)
+#endif
+
+static void cstbase_asyncReadDone( cstbase_device* dev, int rc, unsigned char* buf, void* arg );
+static void cstbase_asyncWriteDone( cstbase_device* dev, int rc, unsigned char* buf, void* arg );
+
+//
+static void cstbase_asyncDone( cstbase_request* req, int rc )
+{
+    req->rc = rc;
+#if defined(CSTBASE_ASYNC_LOWLEVEL)
+    req->done = 1;
+    if( req->cb ) req->cb( req );
+#else
+    POLL_LOCK();
+    req->next = NULL;
+    *cstbase_doneTail = req;
+    cstbase_doneTail = &req->next;
+    POLL_UNLOCK();
+#endif
+}
+
+// call back requests that finished inside submit, oldest first
+// returns how many
+static int cstbase_asyncRunDone(void)
+{
+    int n = 0;
+#if !defined(CSTBASE_ASYNC_LOWLEVEL)
+    POLL_LOCK();
+    cstbase_request* req = cstbase_doneWaiting;
+    cstbase_doneWaiting = NULL;
+    cstbase_doneTail = &cstbase_doneWaiting;
+    POLL_UNLOCK();
+    while( req ) {  // ones the callbacks submit wait for the next call
+        cstbase_request* next = req->next;
+        cstbase_callback cb = req->cb;
+        req->done = 1;
+        if( cb ) cb( req );
+        req = next;
+        n++;
+    }
+#endif
+    return n;
+}
+
+// go on with req in millis, see cstbase_asyncPollDue()
+static void cstbase_asyncWait( cstbase_request* req, int millis )
+{
+    req->next_poll = cstbase_millis() + millis;
+    POLL_LOCK();
+    req->next = cstbase_pollWaiting;
+    cstbase_pollWaiting = req;
+    POLL_UNLOCK();
+}
+
+// SET_REPORT of req, or try again soon if its device is in use
+// returns -1 if it couldn't be started
+static int cstbase_asyncSend( cstbase_request* req )
+{
+    cstbase_devlock* lock;
+    if( cstbase_trylockDev( req->dev, &lock ) == -1 ) {
+        cstbase_asyncWait( req, 1 );
+        return 0;
+    }
+    req->sent = 1;
+    int rc = cstbase_writeAsync( req->dev, req->buf, sizeof(req->buf), 
+                                 cstbase_asyncWriteDone, req );
+    cstbase_unlockDev( lock );
+    return rc;
+}
+
+// GET_REPORT of the report ID 4 table, to look for req's answer
+static int cstbase_asyncGet( cstbase_request* req )
+{
+    req->table[0] = cstbase_resp_report_id;
+    return cstbase_readAsync( req->dev, req->table, sizeof(req->table), 
+                              cstbase_asyncReadDone, req );
+}
+
+// next GET_REPORT of a query, backing off 1,2,4,.. millis between polls
+// like cstbase_transact(). returns -1 if it couldn't be started
+static int cstbase_asyncPoll( cstbase_request* req )
+{
+    int backoff = req->backoff;
+    req->backoff = (backoff==0) ? 1 : (backoff < 16) ? backoff*2 : 16;
+    if( backoff ) { 
+        cstbase_asyncWait( req, backoff );
+        return 0;
+    }
+    return cstbase_asyncGet( req );
+}
+
+// send the GET_REPORTs that are done backing off, & SET_REPORTs that 
+// were waiting for their device. returns millis until the next one is 
+// due, at most timeout_millis
+static int cstbase_asyncPollDue( int timeout_millis )
+{
+    cstbase_request* due = NULL;
+    uint64_t now = cstbase_millis();
+    POLL_LOCK();
+    cstbase_request** p = &cstbase_pollWaiting;
+    while( *p ) { 
+        cstbase_request* req = *p;
+        if( req->next_poll <= now ) {
+            *p = req->next;
+            req->next = due;
+            due = req;
+            continue;
+        }
+        p = &req->next;
+    }
+    POLL_UNLOCK();
+    while( due ) {  // may complete & be queued again, here or elsewhere
+        cstbase_request* req = due;
+        due = req->next;
+        int rc = (req->sent) ? cstbase_asyncGet( req ) 
+                             : cstbase_asyncSend( req );
+        if( rc == -1 ) cstbase_asyncDone( req, -1 );
+    }
+    POLL_LOCK();
+    for( cstbase_request* req = cstbase_pollWaiting; req; req = req->next ) {
+        if( req->next_poll <= now ) timeout_millis = 0;
+        else if( req->next_poll - now < timeout_millis ) 
+            timeout_millis = req->next_poll - now;
+    }
+    POLL_UNLOCK();
+    return timeout_millis;
+}
+
+//
+static void cstbase_asyncReadDone( cstbase_device* dev, int rc, unsigned char* buf, void* arg )
+{
+    cstbase_request* req = arg;
+    if( rc != -1 && !cstbase_findAnswer( req->table, req->buf, req->buf ) ) {
+        if( ++req->polls < cstbase_query_maxpolls ) {  // not yet, ask again
+            if( cstbase_asyncPoll( req ) != -1 ) return;
+        }
+        rc = -1;
+    }
+    if( rc != -1 ) rc = cstbase_decodeResponse( req->buf );
+    cstbase_asyncDone( req, rc );
+}
+
+//
+static void cstbase_asyncWriteDone( cstbase_device* dev, int rc, unsigned char* buf, void* arg )
+{
+    cstbase_request* req = arg;
+    if( rc != -1 && req->want_response ) { 
+        rc = cstbase_asyncGet( req );
+        if( rc != -1 ) return; // read in flight now
+    }
+    cstbase_asyncDone( req, rc );
+}
+
+//
+int cstbase_submit(cstbase_device* dev, cstbase_request* req, 
+                   cstbase_callback cb, void* userdata)
+{
+    req->dev = dev;
+    req->rc = -1;
+    req->done = 0;
+    req->cb = cb;
+    req->userdata = userdata;
+    req->polls = 0;
+    req->backoff = 0;
+    req->sent = 0;
+    req->next = NULL;
+    if( req->want_response ) {
+        req->cmd = req->buf[1];
+        req->seq = req->buf[2] = cstbase_nextSeq();
+    }
+    return cstbase_asyncSend( req );
+}
+
+//
+int cstbase_submitQuery(cstbase_device* dev, cstbase_request* req, uint8_t cmd,
+                        cstbase_callback cb, void* userdata)
+{
+    memset( req->buf, 0, sizeof(req->buf) );
+    req->buf[0] = cstbase_report_id;
+    req->buf[1] = cmd;
+    req->want_response = 1;
+    return cstbase_submit( dev, req, cb, userdata );
+}
+
+//
+int cstbase_handleEvents(int timeout_millis)
+{
+    int wait = cstbase_asyncPollDue( timeout_millis );
+    if( cstbase_asyncRunDone() ) return 0;
+    return cstbase_handleEventsLowlevel( wait, NULL );
+}
+
+//
+int cstbase_waitRequest(cstbase_request* req, int timeout_millis)
+{
+    uint64_t start = cstbase_millis();
+    while( !req->done ) { 
+        int elapsed = cstbase_millis() - start;
+        if( elapsed >= timeout_millis ) return -1;
+        int wait = cstbase_asyncPollDue( timeout_millis - elapsed );
+        if( cstbase_asyncRunDone() ) continue;
+        if( cstbase_handleEventsLowlevel( wait, &req->done ) == -1 ) return -1;
+    }
+    return req->rc;
+}
+
+//
+void cstbase_getTransferStats(cstbase_xfer_stats* stats)
+{
+    stats->sets = cstbase_xfers.sets;  // each one atomic on its own
+    stats->gets = cstbase_xfers.gets;
+}
+
+//
+void cstbase_resetTransferStats(void)
+{
+    memset( &cstbase_xfers, 0, sizeof(cstbase_xfers) );
+}
+
 //-----------------------------------------------------------------------------
 
 //  return current H:M:S time as byte triplet (avoid inflicting time.h on caller)
@@ -166,89 +1366,96 @@ void cstbase_getLocalTime(uint8_t* hours, uint8_t* mins, uint8_t* secs)
 //
 int cstbase_getCachedCount(void)
 {
-    return cstbase_cached_count;
+    REGISTRY_RDLOCK();
+    int count = cstbase_cached_count;
+    REGISTRY_UNLOCK();
+    return count;
 }
 
 //
+int cstbase_isCachedPresent(int i)
+{
+    int present = 0;
+    REGISTRY_RDLOCK();
+    if( i >= 0 && i < cstbase_cached_count ) present = cstbase_infos[i]->present;
+    REGISTRY_UNLOCK();
+    return present;
+}
+
+// entries never move, so this stays valid (but may change on replug)
 const char* cstbase_getCachedPath(int i)
 {
-    return cstbase_infos[i].path;
+    const char* path = NULL;
+    REGISTRY_RDLOCK();
+    if( i >= 0 && i < cstbase_cached_count ) path = cstbase_infos[i]->path;
+    REGISTRY_UNLOCK();
+    return path;
 }
 //
 const char* cstbase_getCachedSerial(int i)
 {
-    return cstbase_infos[i].serial;
+    const char* serial = NULL;
+    REGISTRY_RDLOCK();
+    if( i >= 0 && i < cstbase_cached_count ) serial = cstbase_infos[i]->serial;
+    REGISTRY_UNLOCK();
+    return serial;
 }
 
 //
 int cstbase_getCacheIndexByPath( const char* path ) 
 {
-    for( int i=0; i< cache_max; i++ ) { 
-        if( strcmp( cstbase_infos[i].path, (const char*) path ) == 0 ) return i;
-    }
-    return -1;
+    REGISTRY_RDLOCK();
+    int i = cstbase_findByPath( path );
+    REGISTRY_UNLOCK();
+    return i;
+}
+
+//
+int cstbase_getCacheIndexBySerialnum( uint32_t serialnum ) 
+{
+    REGISTRY_RDLOCK();
+    int i = cstbase_findBySerialnum( serialnum );
+    REGISTRY_UNLOCK();
+    return i;
 }
 
 //
 int cstbase_getCacheIndexBySerial( const char* serial ) 
 {
-    for( int i=0; i< cache_max; i++ ) { 
-        if( strcmp( cstbase_infos[i].serial, serial ) == 0 ) return i;
-    }
-    return -1;
+    if( serial == NULL ) return -1;
+    return cstbase_getCacheIndexBySerialnum( strtoul( serial, NULL, 16 ) );
 }
 
 //
 int cstbase_getCacheIndexByDev( cstbase_device* dev ) 
 {
-    for( int i=0; i< cache_max; i++ ) { 
-        if( cstbase_infos[i].dev == dev ) return i;
-    }
-    return -1;
+    REGISTRY_RDLOCK();
+    int i = cstbase_findByDev( dev );
+    REGISTRY_UNLOCK();
+    return i;
 }
 
 //
 const char* cstbase_getSerialForDev(cstbase_device* dev)
 {
-    int i = cstbase_getCacheIndexByDev( dev );
-    if( i>=0 ) return cstbase_infos[i].serial;
-    return NULL;
+    const char* serial = NULL;
+    REGISTRY_RDLOCK();
+    int i = cstbase_findByDev( dev );
+    if( i>=0 ) serial = cstbase_infos[i]->serial;
+    REGISTRY_UNLOCK();
+    return serial;
 }
 
 //
 int cstbase_clearCacheDev( cstbase_device* dev ) 
 {
-    int i = cstbase_getCacheIndexByDev( dev );
-    if( i>=0 ) cstbase_infos[i].dev = NULL; // FIXME: hmmmm
+    REGISTRY_WRLOCK();
+    int i = cstbase_findByDev( dev );
+    cstbase_registrySetDev( i, NULL );
+    REGISTRY_UNLOCK();
     return i;
 }
 
-
-
-
-// qsort char* string comparison function 
-int cmp_cstbase_info_serial(const void *a, const void *b) 
-{ 
-    cstbase_info* bia = (cstbase_info*) a;
-    cstbase_info* bib = (cstbase_info*) b;
-
-    return strncmp( bia->serial, 
-                    bib->serial, 
-                    serialstrmax);
-} 
-
-
-void cstbase_sortCache(void)
-{
-    size_t elemsize = sizeof( cstbase_info ); //  
-    
-    qsort( cstbase_infos, 
-           cstbase_cached_count, 
-           elemsize, 
-           cmp_cstbase_info_serial);
-}
-
-
 //
 int cstbase_vid(void)
 {
@@ -260,6 +1467,18 @@ int cstbase_pid(void)
     return CSTBASE_DEVICE_ID;
 }
 
+// simple cross-platform monotonic millis, for timeouts
+uint64_t cstbase_millis(void)
+{
+#ifdef WIN32
+    return GetTickCount();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+}
+
 // simple cross-platform millis sleep func
 void cstbase_sleep(uint16_t millis)
 {
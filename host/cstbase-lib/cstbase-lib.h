@@ -15,9 +15,6 @@
 extern "C" {
 #endif
 
-#define cstbase_max_devices 16
-
-#define cache_max 16  
 #define serialstrmax (8 + 1) 
 #define pathstrmax 128
 
@@ -29,28 +26,80 @@ extern "C" {
 #define cstbase_report_id  1
 #define cstbase_report_size 8
 #define cstbase_buf_size (cstbase_report_size+1)
+#define cstbase_send_max (cstbase_report_size-3) // bytes in a report ID 1 'S'
+
+// report ID 2: several commands in one transfer, see cstbase_batch_*()
+#define cstbase_batch_report_id   2
+#define cstbase_batch_report_size 64
+#define cstbase_batch_buf_size (cstbase_batch_report_size+1)
+#define cstbase_batch_max 30   // most commands a batch can hold
+
+// report ID 3: events pushed on the interrupt endpoint, see cstbase_readEvent()
+#define cstbase_event_report_id 3
+
+// report ID 4: answers to the last few queries, see cstbase_queryBegin()
+#define cstbase_resp_report_id   4
+#define cstbase_resp_buf_size    (64+1)
+#define cstbase_resp_slots       8   // answers base station remembers
+#define cstbase_pipeline_max     3   // queries base station can have waiting,
+                                     // its CMD_QUEUE_SIZE-1
+
+// report ID 5: status snapshot, see cstbase_getStatus()
+#define cstbase_status_report_id 5
+#define cstbase_status_buf_size  (16+1)
+
+// how long to poll for a query response before giving up
+#define cstbase_query_timeout  100  // millis
+#define cstbase_query_maxpolls 100  // async GET_REPORTs
 
 struct cstbase_device_;
 
-void cstbase_sortCache(void);
+// control transfer counts, for checking what a call costs on the wire
+typedef struct cstbase_xfer_stats_ {
+    uint32_t sets;   // SET_REPORTs sent
+    uint32_t gets;   // GET_REPORTs done
+} cstbase_xfer_stats;
 
-#if !defined(USE_HIDAPI) && !defined(USE_HIDDATA)
+#if !defined(USE_HIDAPI) && !defined(USE_HIDDATA) && !defined(USE_CSTBASED) && \
+    !defined(USE_SIM)
 #warning "USE_HIDAPI or USE_HIDDATA not defined, choosing USE_HIDAPI"
 #define USE_HIDAPI
 #endif
 
-#if defined(USE_HIDAPI)
+// USE_CSTBASED is the client build, talking to cstbased instead of USB
+#if defined(USE_CSTBASED)
+typedef struct cstbased_device_ cstbase_device; // <-- opaque cstbase data structure
+#elif defined(USE_HIDAPI)
 typedef struct hid_device_ cstbase_device; // <-- opaque cstbase data structure
 #elif defined(USE_HIDDATA)
 typedef struct usbDevice   cstbase_device; // <-- opaque cstbase data structure
+#elif defined(USE_SIM)
+typedef struct cstsim_station_ cstbase_device; // virtual stations, cstbase-sim.h
 #endif
 
 
 //
 // public functions
 // 
+// built with CSTBASE_THREADSAFE (Makefile THREADSAFE=1, the default), these
+// can be called from several threads at once. calls on different devices
+// run in parallel, calls on the same device take turns. exceptions: 
+// cstbase_init(), cstbase_shutdown() and cstbase_hotplugStart/Stop() 
+// belong to one thread
+//
+
+// optional: start a persistent library context. 
+// keeps the USB stack up and opened devices open between calls,
+// so cstbase_close() returns a device to the pool and the next
+// cstbase_open*() of the same device reuses it. returns 0 on success
+int          cstbase_init(void);
+
+// close all pooled devices and release the USB stack
+void         cstbase_shutdown(void);
 
-// scan USB for CST Base devices
+// scan USB for CST Base devices, returns number found
+// each device gets an id the first time it's seen and keeps it, 
+// devices in the same scan get ids in serial number order
 int          cstbase_enumerate();
 
 // scan USB for devices by given VID,PID
@@ -65,8 +114,8 @@ cstbase_device* cstbase_openByPath(const char* path);
 // open CST Base by 8-digit serial number
 cstbase_device* cstbase_openBySerial(const char* serial);
 
-// open by "id", which if from 0-cstbase_max_devices is index
-// or if >cstbase_max_devices, is numerical representation of serial number
+// open by "id", which if less than cstbase_getCachedCount() is device id
+// otherwise is numerical representation of serial number
 cstbase_device* cstbase_openById( uint32_t i );
 
 // close open device
@@ -75,9 +124,38 @@ void cstbase_close( cstbase_device* dev );
 // low-level write
 int cstbase_write( cstbase_device* dev, void* buf, int len);
 
-// low-level read 
+// low-level read, GET_REPORT only, buf[0] must hold report id
 int cstbase_read( cstbase_device* dev, void* buf, int len);
 
+// query: one SET_REPORT of req, then GET_REPORTs into resp until the 
+// response to it is ready. req[2] is replaced with a sequence number.
+// req==NULL does a single GET_REPORT. req & resp may be the same buffer,
+// both as long as report req[0] is: cstbase_buf_size, or 
+// cstbase_batch_buf_size for batches. returns number of transfers used, 
+// -1 on error
+int cstbase_transact( cstbase_device* dev, uint8_t* req, uint8_t* resp );
+
+// pipelined queries: send several before collecting any answers. each
+// query gets a tag, its sequence byte, and base station keeps the last
+// cstbase_resp_slots answers by tag, so answers can't get mixed up even
+// with other threads or processes querying the same device.
+// needs firmware 1.9+
+//
+// send query req (cstbase_buf_size, report ID 1), req[2] is replaced 
+// with its tag. don't have more than cstbase_pipeline_max waiting.
+// returns tag, -1 on error
+int cstbase_queryBegin( cstbase_device* dev, uint8_t* req );
+
+// wait for answer to req sent by cstbase_queryBegin(), into resp 
+// (cstbase_buf_size). returns number of GET_REPORTs used, -1 on error
+int cstbase_queryEnd( cstbase_device* dev, uint8_t* req, uint8_t* resp );
+
+// run count queries, cmds[i] being 'b', 'R', 'v', keeping up to 
+// cstbase_pipeline_max in flight. results[i] is what the blocking call
+// would return, -1 if it got no answer. returns number answered, -1 on error
+int cstbase_queryPipelined( cstbase_device* dev, const uint8_t* cmds, 
+                            int* results, int count );
+
 
 //
 // actual functionality
@@ -92,15 +170,194 @@ int cstbase_setTimeTo(cstbase_device *dev, uint8_t hours, uint8_t mins, uint8_t
 // get current button state of base station, returns bitfield in lower 3-bits
 int cstbase_getButtons(cstbase_device *dev);
 
-// send arbitrary byte/char stream (up to 6 chars) to watch
+// send arbitrary byte/char stream (up to cstbase_send_max chars) to watch
 int cstbase_sendBytesToWatch(cstbase_device *dev, uint8_t* bytebuf, uint8_t len );
 
+// send any number of bytes to watch, as fast as the 2048 baud link takes
+// them. waits for room in the base station's queue, so takes about 5ms a
+// byte past the first 31. needs firmware 2.1+
+// returns len, -1 on error or if the base station dropped any bytes
+int cstbase_streamToWatch(cstbase_device *dev, uint8_t* buf, int len);
+
 // receive last byte sent from watch to base station
 int cstbase_getByteFromWatch(cstbase_device *dev);
 
+// drain bytes the watch sent since the last call, oldest first, up to maxlen
+// base station buffers 31 bytes. overflow (may be NULL) gets its count of 
+// bytes lost, since power up & wrapping at 256. needs firmware 1.5+
+// returns number of bytes read, -1 on error
+int cstbase_readWatchBytes(cstbase_device *dev, uint8_t* buf, int maxlen,
+                           uint8_t* overflow);
+
 // get firmware version of base station
 int cstbase_getVersion(cstbase_device *dev);
 
+// base station's queues to & from the watch, see cstbase_getUartStats()
+typedef struct cstbase_uart_stats_ {
+    int tx_depth;     // bytes waiting to go to watch
+    int tx_max;       // most bytes ever waiting to go
+    int tx_overflow;  // bytes for watch dropped on a full queue, wraps at 256
+    int rx_depth;     // bytes from watch waiting for cstbase_readWatchBytes()
+    int rx_overflow;  // bytes from watch lost, wraps at 256
+} cstbase_uart_stats;
+
+// get queue depths & overflow counts. needs firmware 1.6+
+// returns 0, -1 on error
+int cstbase_getUartStats(cstbase_device *dev, cstbase_uart_stats* stats);
+
+// everything at once, see cstbase_getStatus()
+typedef struct cstbase_status_ {
+    int buttons;         // as cstbase_getButtons()
+    int last_byte;       // as cstbase_getByteFromWatch()
+    int rx_depth;        // bytes from watch waiting for cstbase_readWatchBytes()
+    int rx_overflow;     // bytes from watch lost, wraps at 256
+    int tx_depth;        // bytes waiting to go to watch
+    int docked;          // watch docked & talking
+    int charged;         // watch battery charged
+    int five_volts;      // charger output switched to 5V, for battery check
+    int version;         // as cstbase_getVersion()
+    uint32_t uptime;     // seconds since base station powered up
+    int commands;        // commands & batches received, wraps at 65536
+    int commands_dropped;  // lost to full command queue, wraps at 256
+    int events_dropped;    // lost to full event queue, wraps at 256
+} cstbase_status;
+
+// get status snapshot in a single GET_REPORT. needs firmware 2.0+
+// returns 0, -1 on error
+int cstbase_getStatus(cstbase_device *dev, cstbase_status* status);
+
+
+//
+// batches: several commands in one SET_REPORT & one GET_REPORT.
+// add commands, then cstbase_batch_run() on one or more devices. 
+// needs firmware 1.3+
+//
+
+typedef struct cstbase_batch_ {
+    uint8_t buf[cstbase_batch_buf_size];  // frame being built
+    int len;          // bytes of buf used
+    int resplen;      // bytes the answer will need
+    int count;        // commands added
+    uint8_t cmds[cstbase_batch_max];
+    int results[cstbase_batch_max];  // after run, one per command, like 
+                                     // the single call, -1 if it didn't run
+} cstbase_batch;
+
+// start an empty batch
+void cstbase_batch_init(cstbase_batch* b);
+
+// add a command. each returns its index in b->results, -1 if batch is full
+int cstbase_batch_setTime(cstbase_batch* b);
+int cstbase_batch_setTimeTo(cstbase_batch* b, uint8_t hours, uint8_t mins, uint8_t secs);
+int cstbase_batch_sendBytesToWatch(cstbase_batch* b, uint8_t* bytebuf, uint8_t len);
+int cstbase_batch_getButtons(cstbase_batch* b);
+int cstbase_batch_getByteFromWatch(cstbase_batch* b);
+int cstbase_batch_getVersion(cstbase_batch* b);
+
+// send batch to dev, filling in b->results. b can be run again, 
+// e.g. on another device. returns number of commands run, -1 on error
+int cstbase_batch_run(cstbase_device* dev, cstbase_batch* b);
+
+
+//
+// events: base station pushes these as they happen, no polling needed.
+// needs firmware 1.4+
+//
+
+#define cstbase_event_buttons  'b'  // buttons changed, data = button bits
+#define cstbase_event_watch    'R'  // byte from watch, data = byte
+#define cstbase_event_docked   'H'  // watch docked
+#define cstbase_event_charged  'B'  // watch battery charged
+#define cstbase_event_charging 'N'  // watch battery charging
+
+typedef struct cstbase_event_ {
+    uint8_t type;     // one of cstbase_event_*
+    uint8_t data;
+    uint8_t seq;      // counts events sent by base station
+    uint8_t dropped;  // counts events base station had no room for
+} cstbase_event;
+
+// wait up to timeout_millis (-1 forever) for the next event from dev.
+// returns 1 with ev filled in, 0 on timeout, -1 on error.
+// doesn't hold up other calls on dev while waiting
+int cstbase_readEvent(cstbase_device* dev, cstbase_event* ev, int timeout_millis);
+
+
+//
+// asynchronous requests, alongside the blocking calls above.
+// on the libusb backend these use async control transfers so one thread 
+// can keep many devices busy; elsewhere the transfers run inside submit.
+// either way callbacks never run from inside submit. queries' answers 
+// come from the report ID 4 table, so they need firmware 1.9+ like 
+// cstbase_queryBegin(), and can't be mixed up with blocking calls' answers
+//
+
+typedef struct cstbase_request_ cstbase_request;
+
+// called when a request completes, from inside cstbase_handleEvents()
+// or cstbase_waitRequest() (on libusb, also from any other thread 
+// handling USB events, like hidapi's input report threads)
+typedef void (*cstbase_callback)(cstbase_request* req);
+
+// a request in flight, owned by caller and must stay valid until done
+struct cstbase_request_ {
+    cstbase_device* dev;
+    uint8_t buf[cstbase_buf_size];  // request report, then response report
+    uint8_t table[cstbase_resp_buf_size];  // report ID 4, answer looked for
+    int want_response;  // do a GET_REPORT after the SET_REPORT
+    int done;           // set to 1 on completion
+    int rc;             // result: -1 on error, else like blocking call
+    uint8_t cmd, seq;   // query being waited on
+    int polls;          // GET_REPORTs so far waiting for response
+    int backoff;        // millis to wait before the next one
+    int sent;           // SET_REPORT submitted, waits while device is busy
+    uint64_t next_poll; // when it is due, if waiting
+    cstbase_request* next;  // in list of requests waiting to poll
+    cstbase_callback cb;  // optional, called on completion
+    void* userdata;       // for cb's use
+};
+
+// start request already filled into req->buf & req->want_response
+// for queries, buf[2] is replaced with a sequence number
+// returns 0 if submitted, -1 on error
+int cstbase_submit(cstbase_device* dev, cstbase_request* req, 
+                   cstbase_callback cb, void* userdata);
+
+// start a query: 'b' (buttons), 'v' (version), 'R' (byte from watch)
+// on completion req->rc is what the matching blocking call would return
+int cstbase_submitQuery(cstbase_device* dev, cstbase_request* req, uint8_t cmd,
+                        cstbase_callback cb, void* userdata);
+
+// run completion callbacks, waiting up to timeout_millis for USB events.
+// also sends queries' GET_REPORTs that were backing off, so keep calling 
+// it while requests are in flight
+int cstbase_handleEvents(int timeout_millis);
+
+// wait until req is done, returns req->rc or -1 on timeout
+int cstbase_waitRequest(cstbase_request* req, int timeout_millis);
+
+
+//
+// hotplug: keep the device cache up to date as base stations come and go,
+// so cstbase_enumerate() & the cache lookups need no USB traffic
+//
+
+// called for each base station plugged in (arrived=1) or removed (arrived=0)
+// a removed device's handle stays open, its calls failing, until 
+// cstbase_shutdown(), as other threads may still be using it. callbacks
+// don't overlap, and mustn't call cstbase_hotplugStart/Stop()
+typedef void (*cstbase_hotplug_callback)(int arrived, const char* serial, 
+                                         void* userdata);
+
+// start following hotplug events, calling optional cb for each. needs
+// cstbase_init(). cb is called for devices already present before this 
+// returns, afterwards from inside cstbase_handleEvents().
+// returns 0 on success, -1 if backend has no hotplug (only libusb HIDAPI)
+int cstbase_hotplugStart(cstbase_hotplug_callback cb, void* userdata);
+
+// stop following hotplug events, cstbase_enumerate() scans USB again
+void cstbase_hotplugStop(void);
+
 
 //
 // misc utilities
@@ -109,14 +366,18 @@ int cstbase_getVersion(cstbase_device *dev);
 // return the current local time as H,M,S (0-23,0-59,0-59)
 void cstbase_getLocalTime(uint8_t* hours, uint8_t* mins, uint8_t* secs);
 
+// device cache, indexed by id. ids of unplugged devices stay reserved
+int          cstbase_isCachedPresent(int i);
 const char*  cstbase_getCachedPath(int i);
 const char*  cstbase_getCachedSerial(int i);
 int          cstbase_getCacheIndexByPath( const char* path );
 int          cstbase_getCacheIndexBySerial( const char* serial );
+int          cstbase_getCacheIndexBySerialnum( uint32_t serialnum );
 int          cstbase_getCacheIndexByDev( cstbase_device* dev );
 int          cstbase_clearCacheDev( cstbase_device* dev );
 
 const char*  cstbase_getSerialForDev(cstbase_device* dev);
+// number of ids handed out, present or not
 int          cstbase_getCachedCount(void);
 
 // return VID for CST Base Station
@@ -127,6 +388,13 @@ int cstbase_pid(void);
 // sleep for some millis
 void cstbase_sleep(uint16_t delayMillis);
 
+// copy out / zero the running control transfer counts
+void cstbase_getTransferStats(cstbase_xfer_stats* stats);
+void cstbase_resetTransferStats(void);
+
+// monotonic millisecond clock
+uint64_t cstbase_millis(void);
+
 char *cstbase_error_msg(int errCode);
 
 
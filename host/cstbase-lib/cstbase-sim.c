@@ -0,0 +1,632 @@
+/*
+ * cstbase-sim.c -- virtual CST Base Stations, for the USE_SIM build
+ *
+ * 2014, Tod E. Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ * Follows the firmware's handleMessage(), handleBatch() & sendStatus(),
+ * see firmware/cstbase-hid/main.c for the report formats.
+ *
+ * Timing model: the firmware main loop runs commands in order, and
+ * blocks when the TX ring to the watch is full. So each station has a
+ * time its main loop is free again, and a time its TX ring is empty.
+ * A query's answer shows up once its command has run. Nothing runs in
+ * the background, times are worked out whenever the station is used.
+ *
+ * Transfers the firmware holds off (a SET_REPORT with the command queue
+ * full, a batch while the last one hasn't run) wait here until it would
+ * let them go on, or fail if that's longer than the host waits.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cstbase-sim.h"
+
+#define sim_ver_major '2'
+#define sim_ver_minor '1'
+
+// same sizes as firmware
+#define RX_RING_SIZE     32
+#define TX_RING_SIZE     32
+#define EVENT_QUEUE_SIZE 16
+#define RESP_SLOTS       8
+#define CMD_QUEUE_SIZE   4     // holds CMD_QUEUE_SIZE-1 commands
+#define SEND_MAX         5     // bytes one report ID 1 'S' carries
+#define ECHO_SIZE        256   // bytes on their way back from the watch
+#define REPORT_SIZE      8     // report ID 1, incl. report id, as firmware sends
+#define BIG_SIZE         (64+1)
+#define STATUS_SIZE      (16+1)
+#define HOST_TIMEOUT_US  1000000  // hidapi's control transfer timeout
+
+typedef struct sim_answer_ {
+    uint8_t buf[BIG_SIZE];
+    uint64_t readyAt;    // micros
+} sim_answer;
+
+struct cstsim_station_ {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;  // signaled on new events
+    int id;
+    char serial[9];
+    char path[16];
+
+    uint8_t porta;       // buttons on RA3,RA4,RA5, low = pressed
+    uint8_t lastRxByte;
+    uint8_t rxRing[RX_RING_SIZE];
+    uint8_t rxHead, rxTail, rxOverflow;
+    uint8_t txMaxDepth, txOverflow;
+    uint64_t txDoneAt;   // TX ring empty from then on
+    uint64_t mainFree;   // main loop done with queued commands by then
+    uint64_t cmdDoneAt[CMD_QUEUE_SIZE];  // when each queued command has run
+    int cmdHead, cmdTail;
+    uint8_t  echo[ECHO_SIZE];
+    uint64_t echoAt[ECHO_SIZE];
+    int echoHead, echoTail;
+
+    sim_answer single;   // hid_send_buf
+    sim_answer batch;    // batch_resp
+    sim_answer slots[RESP_SLOTS];
+    int respNext;
+
+    uint8_t eventTypes[EVENT_QUEUE_SIZE];
+    uint8_t eventData[EVENT_QUEUE_SIZE];
+    int eventHead, eventTail;
+    uint8_t eventSeq, eventsDropped;
+
+    uint16_t cmdsReceived;
+    uint8_t cmdsDropped;
+    int docked, charged;
+};
+
+static cstsim_station* sim_stations;
+static int sim_count;
+static int sim_usb_us = 1000;
+static int sim_byte_us;       // micros per byte on watch link, 0 = instant
+static uint64_t sim_start;
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+
+//
+static uint64_t sim_micros(void)
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+static int sim_envInt( const char* name, int def )
+{
+    const char* s = getenv( name );
+    return s ? strtol( s, NULL, 0 ) : def;
+}
+
+//
+static void sim_setup(void)
+{
+    sim_count  = sim_envInt( "CSTBASE_SIM_COUNT", 4 );
+    sim_usb_us = sim_envInt( "CSTBASE_SIM_USB_US", 1000 );
+    int baud   = sim_envInt( "CSTBASE_SIM_BAUD", 2048 );
+    sim_byte_us = (baud > 0) ? 10 * 1000000 / baud : 0;  // 8N1
+    if( sim_count < 0 ) sim_count = 0;
+
+    sim_stations = calloc( sim_count ? sim_count : 1, sizeof(cstsim_station) );
+    if( sim_stations == NULL ) {
+        sim_count = 0;
+        return;
+    }
+    sim_start = sim_micros();
+    for( int i=0; i< sim_count; i++ ) {
+        cstsim_station* st = &sim_stations[i];
+        pthread_mutex_init( &st->lock, NULL );
+        pthread_cond_init( &st->cond, NULL );
+        st->id = i;
+        snprintf( st->serial, sizeof(st->serial), "%08X", 0x10000000 + i );
+        snprintf( st->path, sizeof(st->path), "sim:%d", i );
+        st->porta = 0x38;  // nothing pressed
+        st->docked = 1;
+    }
+}
+
+//
+int cstsim_init(void)
+{
+    pthread_once( &sim_once, sim_setup );
+    return (sim_stations) ? 0 : -1;
+}
+
+//
+int cstsim_count(void)
+{
+    cstsim_init();
+    return sim_count;
+}
+
+//
+const char* cstsim_serial(int i)
+{
+    if( i < 0 || i >= cstsim_count() ) return NULL;
+    return sim_stations[i].serial;
+}
+
+//
+const char* cstsim_path(int i)
+{
+    if( i < 0 || i >= cstsim_count() ) return NULL;
+    return sim_stations[i].path;
+}
+
+//
+cstsim_station* cstsim_openPath(const char* path)
+{
+    int i;
+    if( path == NULL || sscanf( path, "sim:%d", &i ) != 1 ) return NULL;
+    if( i < 0 || i >= cstsim_count() ) return NULL;
+    return &sim_stations[i];
+}
+
+//
+cstsim_station* cstsim_openSerial(const char* serial)
+{
+    if( serial == NULL ) return NULL;
+    long i = strtol( serial, NULL, 16 ) - 0x10000000;
+    if( i < 0 || i >= cstsim_count() ) return NULL;
+    return &sim_stations[i];
+}
+
+// ------------- station internals, called with st->lock held ---------------
+
+// like firmware's queueEvent()
+static void sim_queueEvent( cstsim_station* st, uint8_t type, uint8_t data )
+{
+    int next = (st->eventHead + 1) % EVENT_QUEUE_SIZE;
+    if( next == st->eventTail ) {
+        st->eventsDropped++;
+        return;
+    }
+    st->eventTypes[st->eventHead] = type;
+    st->eventData[st->eventHead]  = data;
+    st->eventHead = next;
+    pthread_cond_broadcast( &st->cond );
+}
+
+// a byte from the watch reaches the ISR
+static void sim_rxByte( cstsim_station* st, uint8_t c )
+{
+    st->lastRxByte = c;
+    int next = (st->rxHead + 1) % RX_RING_SIZE;
+    if( next != st->rxTail ) {
+        st->rxRing[st->rxHead] = c;
+        st->rxHead = next;
+    } else {
+        st->rxOverflow++;
+    }
+    sim_queueEvent( st, 'R', c );
+}
+
+// move bytes the watch has sent by now into the RX ring
+static void sim_advance( cstsim_station* st, uint64_t now )
+{
+    while( st->echoTail != st->echoHead && st->echoAt[st->echoTail] <= now ) {
+        sim_rxByte( st, st->echo[st->echoTail] );
+        st->echoTail = (st->echoTail + 1) % ECHO_SIZE;
+    }
+}
+
+// watch sends c, arriving at time 'at'
+static void sim_watchByte( cstsim_station* st, uint8_t c, uint64_t at )
+{
+    int next = (st->echoHead + 1) % ECHO_SIZE;
+    if( next == st->echoTail ) return;  // watch can't keep up, lost
+    st->echo[st->echoHead] = c;
+    st->echoAt[st->echoHead] = at;
+    st->echoHead = next;
+}
+
+// bytes waiting to go to the watch at time now
+static int sim_txDepth( cstsim_station* st, uint64_t now )
+{
+    if( sim_byte_us == 0 || st->txDoneAt <= now ) return 0;
+    int d = (st->txDoneAt - now + sim_byte_us - 1) / sim_byte_us;
+    return (d < TX_RING_SIZE-1) ? d : TX_RING_SIZE-1;
+}
+
+// uart_putc() at time *t, main loop waits for room, moving *t on
+static void sim_putc( cstsim_station* st, uint8_t c, uint64_t* t )
+{
+    uint64_t full = (uint64_t)(TX_RING_SIZE-1) * sim_byte_us;
+    if( st->txDoneAt > *t + full ) *t = st->txDoneAt - full;  // wait for room
+    if( st->txDoneAt < *t ) st->txDoneAt = *t;
+    st->txDoneAt += sim_byte_us;
+    int d = sim_txDepth( st, *t );
+    if( d > st->txMaxDepth ) st->txMaxDepth = d;
+    sim_watchByte( st, c, st->txDoneAt + sim_byte_us );  // echoed back
+}
+
+//
+static void sim_watchSetTime( cstsim_station* st, uint8_t H, uint8_t M, uint64_t* t )
+{
+    char buf[10];
+    snprintf( buf, sizeof(buf), "F%2.2d:%2.2d", H, M );
+    for( char* p = buf; *p; p++ ) sim_putc( st, *p, t );
+}
+
+// like firmware's rxRingRead()
+static uint8_t sim_rxRingRead( cstsim_station* st, uint8_t* buf, uint8_t max )
+{
+    uint8_t n = 0;
+    while( n < max && st->rxTail != st->rxHead ) {
+        buf[n++] = st->rxRing[st->rxTail];
+        st->rxTail = (st->rxTail + 1) % RX_RING_SIZE;
+    }
+    return n;
+}
+
+// like firmware's handleMessage(), run at time t
+static void sim_handleMessage( cstsim_station* st, const uint8_t* msgbuf, uint64_t t )
+{
+    uint8_t cmd = msgbuf[1];
+    uint8_t seq = msgbuf[2];
+    uint8_t* out = st->single.buf;
+
+    if( cmd == 'T' ) {
+        sim_watchSetTime( st, msgbuf[2], msgbuf[3], &t );
+        st->mainFree = t;
+        return;
+    }
+    else if( cmd == 'S' ) {
+        uint8_t cnt = msgbuf[2];
+        if( cnt > SEND_MAX ) cnt = SEND_MAX;
+        for( int i=0; i< cnt; i++ ) sim_putc( st, msgbuf[3+i], &t );
+        st->mainFree = t;
+        return;
+    }
+
+    memset( out, 0, REPORT_SIZE );
+    if( cmd == 'R' ) {
+        out[3] = st->lastRxByte;
+    }
+    else if( cmd == 'r' ) {
+        uint8_t max = msgbuf[3];
+        if( max > REPORT_SIZE-5 ) max = REPORT_SIZE-5;
+        out[3] = sim_rxRingRead( st, out+5, max );
+        out[4] = st->rxOverflow;
+    }
+    else if( cmd == 'q' ) {
+        out[3] = sim_txDepth( st, t );
+        out[4] = st->txMaxDepth;
+        out[5] = st->txOverflow;
+        out[6] = (st->rxHead - st->rxTail + RX_RING_SIZE) % RX_RING_SIZE;
+        out[7] = st->rxOverflow;
+    }
+    else if( cmd == 'b' ) {
+        out[3] = st->porta;
+    }
+    else if( cmd == 'v' ) {
+        out[3] = sim_ver_major;
+        out[4] = sim_ver_minor;
+    }
+    out[0] = 1;
+    out[1] = cmd;
+    out[2] = seq;
+    st->single.readyAt = t;
+    st->mainFree = t;
+
+    sim_answer* slot = &st->slots[st->respNext];
+    memcpy( slot->buf, out, REPORT_SIZE );
+    slot->readyAt = t;
+    st->respNext = (st->respNext + 1) % RESP_SLOTS;
+}
+
+// like firmware's handleBatch(), run at time t
+static void sim_handleBatch( cstsim_station* st, const uint8_t* in, uint64_t t )
+{
+    uint8_t* out = st->batch.buf;
+    uint8_t seq = in[2];
+    uint8_t cnt = in[3];
+    int i = 4, o = 4, ran = 0;
+
+    memset( out, 0, BIG_SIZE );
+    while( ran < cnt ) {
+        if( i+2 > BIG_SIZE ) break;
+        uint8_t cmd = in[i];
+        uint8_t n   = in[i+1];
+        const uint8_t* args = in + i + 2;
+        if( n > BIG_SIZE - 2 - i ) break;
+
+        uint8_t rn = (cmd == 'b' || cmd == 'R' || cmd == 'r') ? 1 :
+                     (cmd == 'v') ? 2 : (cmd == 'q') ? 5 : 0;
+        if( rn+2 > BIG_SIZE - o ) break;
+
+        if(      cmd == 'T' && n >= 2 ) {
+            sim_watchSetTime( st, args[0], args[1], &t );
+        }
+        else if( cmd == 'S' ) {
+            for( int j=0; j< n; j++ ) sim_putc( st, args[j], &t );
+        }
+        else if( cmd == 'b' ) {
+            out[o+2] = st->porta;
+        }
+        else if( cmd == 'R' ) {
+            out[o+2] = st->lastRxByte;
+        }
+        else if( cmd == 'r' && n >= 1 ) {
+            uint8_t max = BIG_SIZE - o - 3;
+            if( args[0] < max ) max = args[0];
+            rn += sim_rxRingRead( st, out+o+3, max );
+            out[o+2] = st->rxOverflow;
+        }
+        else if( cmd == 'v' ) {
+            out[o+2] = sim_ver_major;
+            out[o+3] = sim_ver_minor;
+        }
+        else if( cmd == 'q' ) {
+            out[o+2] = sim_txDepth( st, t );
+            out[o+3] = st->txMaxDepth;
+            out[o+4] = st->txOverflow;
+            out[o+5] = (st->rxHead - st->rxTail + RX_RING_SIZE) % RX_RING_SIZE;
+            out[o+6] = st->rxOverflow;
+        }
+        else {
+            break;
+        }
+        out[o+0] = cmd;
+        out[o+1] = rn;
+        o += 2 + rn;
+        i += 2 + n;
+        ran++;
+    }
+    out[0] = 2;
+    out[1] = 'B';
+    out[3] = ran;
+    out[2] = seq;
+    st->batch.readyAt = t;
+    st->mainFree = t;
+}
+
+// like firmware's sendStatus()
+static void sim_status( cstsim_station* st, uint8_t* out, uint64_t now )
+{
+    uint32_t up = (now - sim_start) / 1000000;
+    memset( out, 0, STATUS_SIZE );
+    out[0]  = 5;
+    out[1]  = st->porta;
+    out[2]  = st->lastRxByte;
+    out[3]  = (st->rxHead - st->rxTail + RX_RING_SIZE) % RX_RING_SIZE;
+    out[4]  = st->rxOverflow;
+    out[5]  = (st->docked ? 0x01 : 0) | (st->charged ? 0x02 : 0);
+    out[6]  = sim_ver_major;
+    out[7]  = sim_ver_minor;
+    out[8]  = up;
+    out[9]  = up >> 8;
+    out[10] = up >> 16;
+    out[11] = up >> 24;
+    out[12] = st->cmdsReceived;
+    out[13] = st->cmdsReceived >> 8;
+    out[14] = st->cmdsDropped;
+    out[15] = st->eventsDropped;
+    out[16] = sim_txDepth( st, now );
+}
+
+// copy answer to buf, with seq byte still 0 if its command hasn't run yet
+static int sim_copyAnswer( sim_answer* a, uint8_t* buf, int len, int size,
+                           uint64_t now )
+{
+    int n = (len < size) ? len : size;
+    memcpy( buf, a->buf, n );
+    if( a->readyAt > now && n > 2 ) buf[2] = 0;
+    return n;
+}
+
+// ------------- transfers ---------------------------------------------------
+
+// USB transfer time, outside the station lock so others can go on
+static void sim_usbDelay(void)
+{
+    if( sim_usb_us > 0 ) usleep( sim_usb_us );
+}
+
+// firmware holds the transfer off (NAKs) until time 'until'. wait for it
+// unless the host gives up first, 'start' being when it began
+// returns 0 if it gave up. st->lock is let go while waiting
+static int sim_holdOff( cstsim_station* st, uint64_t until, uint64_t start )
+{
+    uint64_t now = sim_micros();
+    while( now < until ) {
+        if( now - start >= HOST_TIMEOUT_US ) return 0;
+        uint64_t wait = until - now;
+        if( wait > start + HOST_TIMEOUT_US - now ) 
+            wait = start + HOST_TIMEOUT_US - now;
+        pthread_mutex_unlock( &st->lock );
+        usleep( wait );
+        pthread_mutex_lock( &st->lock );
+        now = sim_micros();
+    }
+    return 1;
+}
+
+// commands the main loop has run by now leave the queue
+static void sim_cmdRetire( cstsim_station* st, uint64_t now )
+{
+    while( st->cmdTail != st->cmdHead && st->cmdDoneAt[st->cmdTail] <= now )
+        st->cmdTail = (st->cmdTail + 1) % CMD_QUEUE_SIZE;
+}
+
+//
+static int sim_cmdQueueFull( cstsim_station* st )
+{
+    return (st->cmdHead + 1) % CMD_QUEUE_SIZE == st->cmdTail;
+}
+
+// like firmware's USBHIDCBSetReportComplete(), then the main loop running
+// it. the SET_REPORT waited for room, the check is only a guard
+static void sim_cmdQueue( cstsim_station* st, const uint8_t* in, uint64_t now )
+{
+    if( sim_cmdQueueFull( st ) ) {
+        st->cmdsDropped++;
+        return;
+    }
+    st->cmdsReceived++;
+    sim_handleMessage( st, in, (st->mainFree > now) ? st->mainFree : now );
+    st->cmdDoneAt[st->cmdHead] = st->mainFree;
+    st->cmdHead = (st->cmdHead + 1) % CMD_QUEUE_SIZE;
+}
+
+//
+int cstsim_setReport(cstsim_station* st, const uint8_t* buf, int len)
+{
+    if( st == NULL || len < 1 ) return -1;
+    uint64_t start = sim_micros();
+    sim_usbDelay();
+    uint8_t in[BIG_SIZE] = {0};
+    memcpy( in, buf, (len < BIG_SIZE) ? len : BIG_SIZE );
+
+    pthread_mutex_lock( &st->lock );
+    int rc = len;
+    if( in[0] == 1 ) {
+        sim_cmdRetire( st, sim_micros() );
+        while( sim_cmdQueueFull( st ) ) {  // until main loop makes room
+            if( !sim_holdOff( st, st->cmdDoneAt[st->cmdTail], start ) ) break;
+            sim_cmdRetire( st, sim_micros() );
+        }
+        if( sim_cmdQueueFull( st ) ) {
+            rc = -1;  // host timed out, never sent the data
+        } else {
+            uint64_t now = sim_micros();
+            sim_advance( st, now );
+            sim_cmdQueue( st, in, now );
+        }
+    }
+    else if( in[0] == 2 ) {
+        if( !sim_holdOff( st, st->batch.readyAt, start ) ) {
+            rc = -1;  // last batch still hadn't run
+        } else {
+            uint64_t now = sim_micros();
+            sim_advance( st, now );
+            st->cmdsReceived++;
+            sim_handleBatch( st, in, (st->mainFree > now) ? st->mainFree : now );
+        }
+    }
+    else {
+        rc = -1;  // firmware stalls the rest
+    }
+    pthread_mutex_unlock( &st->lock );
+    return rc;
+}
+
+//
+int cstsim_getReport(cstsim_station* st, uint8_t* buf, int len)
+{
+    if( st == NULL || len < 1 ) return -1;
+    uint64_t start = sim_micros();
+    sim_usbDelay();
+
+    pthread_mutex_lock( &st->lock );
+    // batch answer is held off until the batch has run
+    if( buf[0] == 2 && !sim_holdOff( st, st->batch.readyAt, start ) ) {
+        pthread_mutex_unlock( &st->lock );
+        return -1;
+    }
+    uint64_t now = sim_micros();
+    sim_advance( st, now );
+    int rc = -1;
+    switch( buf[0] ) {
+    case 1:
+        rc = sim_copyAnswer( &st->single, buf, len, REPORT_SIZE, now );
+        break;
+    case 2:
+        rc = sim_copyAnswer( &st->batch, buf, len, BIG_SIZE, now );
+        break;
+    case 4: {
+        uint8_t table[BIG_SIZE] = {4};
+        for( int i=0; i< RESP_SLOTS; i++ ) {
+            sim_copyAnswer( &st->slots[i], table + 1 + i*REPORT_SIZE,
+                            REPORT_SIZE, REPORT_SIZE, now );
+        }
+        rc = (len < BIG_SIZE) ? len : BIG_SIZE;
+        memcpy( buf, table, rc );
+        break;
+    }
+    case 5: {
+        uint8_t status[STATUS_SIZE];
+        sim_status( st, status, now );
+        rc = (len < STATUS_SIZE) ? len : STATUS_SIZE;
+        memcpy( buf, status, rc );
+        break;
+    }
+    }
+    pthread_mutex_unlock( &st->lock );
+    return rc;
+}
+
+// like firmware's sendEvents()
+int cstsim_readInput(cstsim_station* st, uint8_t* buf, int len, int timeout_millis)
+{
+    if( st == NULL || len < 5 ) return -1;
+    uint64_t deadline = sim_micros() + (uint64_t)timeout_millis * 1000;
+
+    pthread_mutex_lock( &st->lock );
+    while( 1 ) {
+        uint64_t now = sim_micros();
+        sim_advance( st, now );
+        if( st->eventTail != st->eventHead ) break;
+        if( timeout_millis >= 0 && now >= deadline ) {
+            pthread_mutex_unlock( &st->lock );
+            return 0;
+        }
+        // sleep until next byte from watch, timeout, or a new event
+        uint64_t until = (timeout_millis >= 0) ? deadline : now + 1000000;
+        if( st->echoTail != st->echoHead && st->echoAt[st->echoTail] < until )
+            until = st->echoAt[st->echoTail];
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        uint64_t ns = ts.tv_nsec + (until - now) * 1000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait( &st->cond, &st->lock, &ts );
+    }
+    int t = st->eventTail;
+    memset( buf, 0, len );
+    buf[0] = 3;
+    buf[1] = st->eventTypes[t];
+    buf[2] = st->eventData[t];
+    buf[3] = ++st->eventSeq;
+    buf[4] = st->eventsDropped;
+    st->eventTail = (t + 1) % EVENT_QUEUE_SIZE;
+    pthread_mutex_unlock( &st->lock );
+    return (len < REPORT_SIZE) ? len : REPORT_SIZE;
+}
+
+//
+void cstsim_setButtons(int i, int pressed)
+{
+    if( i < 0 || i >= cstsim_count() ) return;
+    cstsim_station* st = &sim_stations[i];
+    pthread_mutex_lock( &st->lock );
+    uint8_t porta = 0x38 & ~((pressed & 7) << 3);
+    if( porta != st->porta ) {
+        st->porta = porta;
+        sim_queueEvent( st, 'b', (porta >> 3) & 7 );
+    }
+    pthread_mutex_unlock( &st->lock );
+}
+
+//
+void cstsim_watchSend(int i, const uint8_t* bytes, int len)
+{
+    if( i < 0 || i >= cstsim_count() ) return;
+    cstsim_station* st = &sim_stations[i];
+    pthread_mutex_lock( &st->lock );
+    uint64_t at = sim_micros();
+    for( int j=0; j< len; j++ ) {
+        at += sim_byte_us;
+        sim_watchByte( st, bytes[j], at );
+    }
+    pthread_cond_broadcast( &st->cond );
+    pthread_mutex_unlock( &st->lock );
+}
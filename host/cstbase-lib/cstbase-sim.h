@@ -0,0 +1,51 @@
+/*
+ * cstbase-sim.h -- virtual CST Base Stations, for the USE_SIM build
+ *
+ * 2014, Tod E. Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ * Stations answer the same reports as the firmware in ../../firmware/cstbase-hid,
+ * with USB transfers and the 2048-baud link to the watch taking as long as
+ * configured. Each has a watch docked that sends back every byte it gets,
+ * like a loopback plug.
+ *
+ * Set up from environment variables when first used:
+ *   CSTBASE_SIM_COUNT   number of stations (default 4)
+ *   CSTBASE_SIM_USB_US  microseconds per control transfer (default 1000)
+ *   CSTBASE_SIM_BAUD    watch link speed, 0 for no delay (default 2048)
+ *
+ */
+
+#ifndef __CSTBASE_SIM_H__
+#define __CSTBASE_SIM_H__
+
+#include <stdint.h>
+
+typedef struct cstsim_station_ cstsim_station;
+
+// create the stations, once. returns 0, -1 on error
+int cstsim_init(void);
+
+// number of stations, and their serial numbers & paths ("sim:N")
+int cstsim_count(void);
+const char* cstsim_serial(int i);
+const char* cstsim_path(int i);
+
+// stations always exist, so opening just finds them. NULL if no such one
+cstsim_station* cstsim_openPath(const char* path);
+cstsim_station* cstsim_openSerial(const char* serial);
+
+// SET_REPORT & GET_REPORT of a feature report, buf[0] is the report id.
+// return bytes transferred, -1 on error
+int cstsim_setReport(cstsim_station* st, const uint8_t* buf, int len);
+int cstsim_getReport(cstsim_station* st, uint8_t* buf, int len);
+
+// next input report (events), waiting up to timeout_millis, -1 forever.
+// returns length, 0 on timeout
+int cstsim_readInput(cstsim_station* st, uint8_t* buf, int len, int timeout_millis);
+
+// for tests: press buttons (bits 0,1,2 = RA3,RA4,RA5, set = pressed),
+// or have station i's watch send bytes
+void cstsim_setButtons(int i, int pressed);
+void cstsim_watchSend(int i, const uint8_t* bytes, int len);
+
+#endif
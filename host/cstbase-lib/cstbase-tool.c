@@ -16,6 +16,15 @@
  * Get firmware verison of base station:
  * ./cstbase-tool --version
  *
+ * Get button state of every base station, 4 at a time:
+ * ./cstbase-tool --buttons --all --jobs 4
+ *
+ * Print button presses and bytes from the watch as they happen:
+ * ./cstbase-tool --events
+ *
+ * Print bytes the watch sent since the last --read:
+ * ./cstbase-tool --read
+ *
  *
  */
 
@@ -27,6 +36,7 @@
 #include <getopt.h>    // for getopt_long()
 #include <time.h>
 #include <unistd.h>    // getuid()
+#include <pthread.h>
 
 #include "cstbase-lib.h"
 
@@ -34,12 +44,32 @@
 
 int delayMillis = 500;
 int numDevicesToUse = 1;
+int maxJobs = 8;   // how many devices to talk to at once
 int ledn = 0;
 
-cstbase_device* dev;
-uint32_t  deviceIds[cstbase_max_devices];
+uint32_t  deviceId0;             // default is first device
+uint32_t* deviceIds = &deviceId0;  // or from --id, allocated to fit
 
 uint8_t cmdbuf[cstbase_buf_size]; 
+uint8_t sendbuf[256];  // for --send & --sendbytes
+int sendlen;
+
+static int cmd;
+
+// one per selected device, results are printed after all jobs finish
+typedef struct job_ {
+    uint32_t id;
+    char serial[serialstrmax+1];
+    cstbase_device* dev;
+    int rc;
+    char msgstr[80];  // muted by --quiet
+    char valstr[100]; // always printed
+} job_t;
+
+static job_t* jobs;
+static int jobCount;
+static int jobNext;
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
 
 int verbose;
 int quiet=0;
@@ -57,13 +87,21 @@ static void usage(char *myName)
 "  --settime                   Set time to current localtime\n"
 "  --settimeto HH:MM           Set time to specified HH:MM time\n"
 "  --buttons                   Get base station button states\n"
-"  --send                      Send byte sequence to watch\n"
+"  --status                    Get buttons, watch, battery state & more at once\n"
+"  --send chars                Send character string to watch\n"
+"  --sendbytes b1,b2,...       Send byte sequence (dec or 0x hex) to watch\n"
 "  --get                       Read last received byte from watch\n"
 "  --list                      List connected CST Base devices \n"
+"  --monitor                   Print CST Base devices as they come and go\n"
+"  --events                    Print button & watch events as they happen\n"
+"  --read                      Read all bytes received from watch since last read\n"
 " Nerd functions: (not used normally) \n"
 "  --version                   Display cstbase-tool & basestation version info \n"
+"  --uartstats                 Display base station's watch queue stats \n"
 "and [options] are: \n"
 "  -d dNums --id all|deviceIds Use these cstbase ids (from --list) \n"
+"  -a, --all                   Use all cstbase devices, same as '--id all' \n"
+"  -j num,  --jobs num         Talk to at most num devices at once (default 8)\n"
 "  -q, --quiet                 Mutes all stdout output (supercedes --verbose)\n"
 "  -v, --verbose               verbose debugging msgs\n"
 "\n"
@@ -71,6 +109,7 @@ static void usage(char *myName)
 "  cstbase-tool --settime --all   # set all connected devices to current time\n"
 "  cstbase-tool --settimeto 6:11  # set time to 6:11\n"
 "  cstbase-tool --buttons         # get button state of base station\n"
+"  cstbase-tool --version --all   # get firmware version of all base stations\n"
 "\n"
 //"  -t ms,   --delay=millis     Set millisecs between events (default 500)\n"
             ,myName);
@@ -88,13 +127,21 @@ enum {
     CMD_SENDBYTES,
     CMD_GETCHAR,
     CMD_GETBYTE,
+    CMD_READBYTES,
+    CMD_UARTSTATS,
+    CMD_STATUS,
     CMD_TESTTEST,
+    CMD_MONITOR,
+    CMD_EVENTS,
 };
 
 
 void msg(char* fmt, ...);
 void hexdump(uint8_t *buffer, int len);
 int hexread(uint8_t *buffer, char *string, int buflen);
+int idsread(uint32_t *ids, char *string, int maxids);
+static void runJobs(void);
+static void monitorEvent(int arrived, const char* serial, void* userdata);
 
 //
 int main(int argc, char** argv)
@@ -102,18 +149,13 @@ int main(int argc, char** argv)
     int openall = 0;
     int16_t arg=0;
 
-    int  rc;
-    char serialnumstr[serialstrmax] = {'\0'}; 
-
     uint16_t seed = time(NULL);
     srand(seed);
     memset( cmdbuf, 0, sizeof(cmdbuf));
 
-    static int cmd  = CMD_NONE;
-
     // parse options
     int option_index = 0, opt;
-    char* opt_str = "aqvhm:t:d:U:u:l:";
+    char* opt_str = "aqvhm:t:d:j:U:u:l:";
     static struct option loptions[] = {
         {"all",        no_argument,       0,      'a'},
         {"verbose",    optional_argument, 0,      'v'},
@@ -121,6 +163,7 @@ int main(int argc, char** argv)
         {"millis",     required_argument, 0,      'm'},
         {"delay",      required_argument, 0,      't'},
         {"id",         required_argument, 0,      'd'},
+        {"jobs",       required_argument, 0,      'j'},
         {"help",       no_argument,       0,      'h'},
         {"list",       no_argument,       &cmd,   CMD_LIST },
         {"version",    no_argument,       &cmd,   CMD_VERSION },
@@ -131,7 +174,12 @@ int main(int argc, char** argv)
         {"sendbytes",  required_argument, &cmd,   CMD_SENDBYTES },
         {"get",        no_argument,       &cmd,   CMD_GETCHAR },
         {"getbyte",    no_argument,       &cmd,   CMD_GETBYTE },
+        {"read",       no_argument,       &cmd,   CMD_READBYTES },
+        {"uartstats",  no_argument,       &cmd,   CMD_UARTSTATS },
+        {"status",     no_argument,       &cmd,   CMD_STATUS },
         {"testtest",   no_argument,       &cmd,   CMD_TESTTEST },
+        {"monitor",    no_argument,       &cmd,   CMD_MONITOR },
+        {"events",     no_argument,       &cmd,   CMD_EVENTS },
         {NULL,         0,                 0,      0}
     };
     while(1) {
@@ -144,11 +192,12 @@ int main(int argc, char** argv)
                 hexread(cmdbuf, optarg, sizeof(cmdbuf));  // cmd w/ hexlist arg
                 break;
             case CMD_SENDCHARS:
-                strncpy((char*)cmdbuf, optarg, sizeof(cmdbuf));
-                cmdbuf[ strlen(optarg) ] = '\0';
+                sendlen = strlen(optarg);
+                if( sendlen > sizeof(sendbuf) ) sendlen = sizeof(sendbuf);
+                memcpy( sendbuf, optarg, sendlen );
                 break;
             case CMD_SENDBYTES:
-                hexread(cmdbuf, optarg, sizeof(cmdbuf));  // cmd w/ hexlist arg
+                sendlen = hexread(sendbuf, optarg, sizeof(sendbuf));
                 break;
             } // switch(cmd)
             break;
@@ -158,6 +207,9 @@ int main(int argc, char** argv)
         case 't':
             delayMillis = strtol(optarg,NULL,10);
             break;
+        case 'j':
+            maxJobs = strtol(optarg,NULL,10);
+            break;
         case 'q':
             if( optarg==NULL ) quiet++;
             else quiet = strtol(optarg,NULL,0);
@@ -171,10 +223,7 @@ int main(int argc, char** argv)
             break;
         case 'd':
             if( strcmp(optarg,"all") == 0 ) {
-                numDevicesToUse = 0; //cstbase_max_devices;
-                for( int i=0; i< cstbase_max_devices; i++) {
-                    deviceIds[i] = i;
-                }
+                numDevicesToUse = 0; // filled in after enumerate
             } 
             else if( strlen(optarg) == 8 ) { //  
                 deviceIds[0] = strtol( optarg, NULL, 16);
@@ -182,7 +231,9 @@ int main(int argc, char** argv)
                 //sprintf( serialnumstr, "%s", optarg);  // strcpy
             } 
             else {
-                numDevicesToUse = hexread((uint8_t*)deviceIds,optarg,sizeof(deviceIds));
+                int maxids = strlen(optarg)/2 + 1;
+                deviceIds = calloc( maxids, sizeof(uint32_t) );
+                numDevicesToUse = idsread(deviceIds,optarg,maxids);
             }
             break;
         case 'h':
@@ -200,107 +251,246 @@ int main(int argc, char** argv)
     // get a list of all devices and their paths
     int count = cstbase_enumerate();
 
-    if( cmd == CMD_VERSION ) { 
-        char verbuf[40] = "";
-        if( count ) { 
-            dev = cstbase_openById( deviceIds[0] );
-            rc = cstbase_getVersion(dev);
-            cstbase_close(dev);
-            sprintf(verbuf, ", fw version: %d", rc);
+    if( cmd == CMD_MONITOR ) { // runs until killed
+        cstbase_init();
+        if( cstbase_hotplugStart( monitorEvent, NULL ) == -1 ) {
+            msg("--monitor not supported in this build\n");
+            exit(1);
+        }
+        while( 1 ) {
+            cstbase_handleEvents( 1000 );
         }
-        msg("cstbase-tool version: %s %s\n",CSTBASE_TOOL_VERSION,verbuf);
-        exit(0);
     }
 
+    if( cmd == CMD_VERSION && count == 0 ) { 
+        msg("cstbase-tool version: %s\n",CSTBASE_TOOL_VERSION);
+        exit(0);
+    }
     
     if( count == 0 ) {
         msg("no CST Base devices found\n");
         exit(1);
     }
 
-    if( numDevicesToUse == 0 ) numDevicesToUse = count; 
+    if( openall ) numDevicesToUse = 0;
+    if( numDevicesToUse == 0 ) { // "all"
+        deviceIds = calloc( count, sizeof(uint32_t) );
+        for( int i=0; i< cstbase_getCachedCount(); i++) {
+            if( cstbase_isCachedPresent(i) ) deviceIds[numDevicesToUse++] = i;
+        }
+    }
 
     if( verbose ) { 
         printf("deviceId[0] = %X\n", deviceIds[0]);
         printf("cached list:\n");
-        for( int i=0; i< count; i++ ) { 
+        for( int i=0; i< cstbase_getCachedCount(); i++ ) { 
             printf("%d: serial: '%s' '%s'\n", 
                    i, cstbase_getCachedSerial(i), cstbase_getCachedPath(i) );
         }
     }
 
-    // actually open up the device to start talking to it
-    if(verbose) printf("openById: %X\n", deviceIds[0]);
-    dev = cstbase_openById( deviceIds[0] );
-
-    if( dev == NULL ) { 
-        msg("cannot open CST Base, bad id or serial number\n");
-        exit(1);
-    }
-
     //
     // begin command processing
     //
     if( cmd == CMD_LIST ) { 
         printf("CST Base list: \n");
-        for( int i=0; i< count; i++ ) {
+        for( int i=0; i< cstbase_getCachedCount(); i++ ) {
+            if( !cstbase_isCachedPresent(i) ) continue;
             printf("id:%d - serialnum:%s \n", i, cstbase_getCachedSerial(i) );
         }
         #ifdef USE_HIDDATA
         printf("(Listing not supported in HIDDATA builds)\n"); 
         #endif
+        return 0;
+    }
+    if( cmd == CMD_NONE || cmd == CMD_TESTTEST ) {
+        return 0;
+    }
+
+    // keep USB up so devices can be open at the same time
+    cstbase_init();
+
+    // open all selected devices, then run cmd on them in parallel
+    jobs = calloc( numDevicesToUse, sizeof(job_t) );
+    int opened = 0;
+    for( int i=0; i< numDevicesToUse; i++ ) {
+        if(verbose) printf("openById: %X\n", deviceIds[i]);
+        jobs[i].id  = deviceIds[i];
+        jobs[i].dev = cstbase_openById( deviceIds[i] );
+        jobs[i].rc  = -1;
+        const char* serial = cstbase_getSerialForDev( jobs[i].dev );
+        if( serial ) strcpy( jobs[i].serial, serial );
+        else sprintf( jobs[i].serial, "%X", deviceIds[i] );
+        if( jobs[i].dev ) opened++;
+        else sprintf( jobs[i].msgstr, "cannot open\n");
+    }
+    jobCount = numDevicesToUse;
+
+    if( opened == 0 ) { 
+        msg("cannot open CST Base, bad id or serial number\n");
+        exit(1);
+    }
+
+    if( cmd == CMD_EVENTS ) { // runs until killed, taking turns on devices
+        cstbase_event ev;
+        int wait = (jobCount > 1) ? 10 : -1;
+        while( 1 ) {
+            for( int i=0; i< jobCount; i++ ) {
+                if( !jobs[i].dev ) continue;
+                int rc = cstbase_readEvent( jobs[i].dev, &ev, wait );
+                if( rc == -1 ) {
+                    msg("%s: error reading events\n", jobs[i].serial);
+                    exit(1);
+                }
+                if( rc == 0 ) continue;
+                if( jobCount > 1 ) printf("%s: ", jobs[i].serial);
+                printf("event '%c' data:0x%02x seq:%d dropped:%d\n",
+                       ev.type, ev.data, ev.seq, ev.dropped);
+                fflush(stdout);
+            }
+        }
+    }
+
+    if( cmd == CMD_SETTIME ) { // same time for everyone
+        cstbase_getLocalTime( &cmdbuf[0], &cmdbuf[1], &cmdbuf[2] );
     }
-    else if( cmd == CMD_VERSION ) { 
+
+    runJobs();
+
+    if( cmd == CMD_VERSION ) {
+        msg("cstbase-tool version: %s", CSTBASE_TOOL_VERSION);
+        msg( (jobCount > 1) ? "\n" : ", " ); // one device stays on one line
+    }
+    int errs = 0;
+    for( int i=0; i< jobCount; i++ ) {
+        if( jobCount > 1 ) msg("%s: ", jobs[i].serial);
+        msg("%s", jobs[i].msgstr);
+        if( jobs[i].valstr[0] ) printf("%s", jobs[i].valstr);
+        if( jobs[i].rc == -1 ) errs++;
+    }
+
+    cstbase_shutdown();
+
+    return (errs) ? 1 : 0;
+}
+
+// run cmd on one opened device, recording what to report
+static void runJob( job_t* job )
+{
+    cstbase_device* dev = job->dev;
+    int rc = -1;
+    if( dev == NULL ) return;
+
+    if( cmd == CMD_VERSION ) { 
         rc = cstbase_getVersion(dev);
-        msg("cstbase-tool: firmware version: ");
-        printf("%d\n",rc);
+        sprintf(job->msgstr, "fw version: %d\n", rc);
     }
     else if( cmd == CMD_SETTIME ) { 
-        cstbase_close(dev); // close global device, open as needed
-        uint8_t h,m,s;
-        cstbase_getLocalTime(&h,&m,&s);
-        for( int i=0; i< numDevicesToUse; i++ ) {
-            dev = cstbase_openById( deviceIds[i] );
-            if( dev == NULL ) continue;
-            msg("set dev:%X to localtime %2.2d:%2.2d\n", deviceIds[i],h,m );
-            rc = cstbase_setTime(dev);
-            cstbase_close( dev );
-        }
+        rc = cstbase_setTimeTo( dev, cmdbuf[0], cmdbuf[1], cmdbuf[2] );
+        sprintf(job->msgstr, "set dev:%X to localtime %2.2d:%2.2d\n", 
+                job->id, cmdbuf[0],cmdbuf[1] );
     }
     else if( cmd == CMD_SETTIMETO ) {
-        // FIXME: not done yet
         uint8_t hours = cmdbuf[0];
         uint8_t mins  = cmdbuf[1];
         uint8_t secs  = cmdbuf[2];
-        msg("setting time to ");
-        printf("%2.2d:%2.2d\n", hours, mins);
         rc = cstbase_setTimeTo( dev, hours, mins, secs );
+        sprintf(job->msgstr, "setting time to ");
+        sprintf(job->valstr, "%2.2d:%2.2d\n", hours, mins);
     }
     else if( cmd == CMD_BUTTONS ) {
         rc = cstbase_getButtons(dev);
-        msg("cstbase-tool: button state: ");
-        printf("0x%x\n",rc);
+        sprintf(job->msgstr, "cstbase-tool: button state: ");
+        sprintf(job->valstr, "0x%x\n",rc);
     }
     else if( cmd == CMD_SENDCHARS ) { 
-        msg("send: %s\n", cmdbuf);
-        rc = cstbase_sendBytesToWatch( dev, cmdbuf, strlen((char*)cmdbuf) );
+        rc = cstbase_streamToWatch( dev, sendbuf, sendlen );
+        sprintf(job->msgstr, "send: %.*s\n", sendlen < 60 ? sendlen : 60, sendbuf);
     }
     else if( cmd == CMD_SENDBYTES ) { 
-        msg("send bytes: %x\n", cmdbuf[0]);
-        rc = cstbase_sendBytesToWatch( dev, cmdbuf, 1 );  // FIXME: only sends 1st byte
+        rc = cstbase_streamToWatch( dev, sendbuf, sendlen );
+        sprintf(job->msgstr, "send bytes: %d bytes, first %x\n", sendlen, sendbuf[0]);
     }
     else if( cmd == CMD_GETCHAR ) { 
         rc = cstbase_getByteFromWatch( dev );
-        msg("get char: %c", rc );
+        sprintf(job->msgstr, "get char: %c\n", rc );
     } 
     else if( cmd == CMD_GETBYTE ) { 
         rc = cstbase_getByteFromWatch( dev );
-        msg("get byte: ");
-        printf("0x%x\n",rc);
+        sprintf(job->msgstr, "get byte: ");
+        sprintf(job->valstr, "0x%x\n",rc);
+    }
+    else if( cmd == CMD_READBYTES ) {
+        uint8_t bytes[31];  // as many as base station buffers
+        uint8_t overflow = 0;
+        rc = cstbase_readWatchBytes( dev, bytes, sizeof(bytes), &overflow );
+        sprintf(job->msgstr, "read %d bytes, %d lost: ", rc, overflow);
+        char* p = job->valstr;
+        for( int i=0; i< rc; i++ ) p += sprintf(p, "%2.2x ", bytes[i]);
+        sprintf(p, "\n");
+    }
+    else if( cmd == CMD_STATUS ) {
+        cstbase_status st;
+        rc = cstbase_getStatus( dev, &st );
+        sprintf(job->msgstr, "status: ");
+        if( rc != -1 )
+            snprintf(job->valstr, sizeof(job->valstr), 
+                     "buttons:0x%x docked:%d charged:%d byte:0x%02x rx:%d "
+                     "fw:%d up:%us cmds:%d\n", 
+                     st.buttons, st.docked, st.charged, st.last_byte,
+                     st.rx_depth, st.version, st.uptime, st.commands);
     }
+    else if( cmd == CMD_UARTSTATS ) {
+        cstbase_uart_stats st;
+        rc = cstbase_getUartStats( dev, &st );
+        sprintf(job->msgstr, "uart stats: ");
+        if( rc != -1 ) 
+            sprintf(job->valstr, "tx:%d max:%d lost:%d rx:%d lost:%d\n",
+                    st.tx_depth, st.tx_max, st.tx_overflow,
+                    st.rx_depth, st.rx_overflow);
+    }
+    job->rc = rc;
+}
 
+// worker thread: keep taking the next job until there are none left
+static void* jobWorker( void* arg )
+{
+    while( 1 ) { 
+        pthread_mutex_lock( &jobLock );
+        int i = jobNext++;
+        pthread_mutex_unlock( &jobLock );
+        if( i >= jobCount ) break;
+        runJob( &jobs[i] );
+    }
+    return NULL;
+}
 
-    return 0;
+// print base stations as they are plugged in or removed
+static void monitorEvent(int arrived, const char* serial, void* userdata)
+{
+    msg("%s serialnum:%s\n", arrived ? "added:  " : "removed:", serial);
+    fflush(stdout);
+}
+
+// run all jobs, at most maxJobs at once
+static void runJobs(void)
+{
+    int nthreads = (maxJobs < jobCount) ? maxJobs : jobCount;
+    pthread_t* threads;
+
+    jobNext = 0;
+    if( nthreads <= 1 ) {  // no need for threads
+        jobWorker(NULL);
+        return;
+    }
+    threads = malloc( nthreads * sizeof(pthread_t) );
+    for( int i=0; i< nthreads; i++ ) { 
+        pthread_create( &threads[i], NULL, jobWorker, NULL );
+    }
+    for( int i=0; i< nthreads; i++ ) { 
+        pthread_join( threads[i], NULL );
+    }
+    free( threads );
 }
 
 
@@ -348,6 +538,18 @@ int hexread(uint8_t *buffer, char *string, int buflen)
     return pos;
 }
 
+// parse a comma-delimited string of device ids (dec,hex) into an id array
+int idsread(uint32_t *ids, char *string, int maxids)
+{
+    char    *s;
+    int     pos = 0;
+    while((s = strtok(string, ", :")) != NULL && pos < maxids){
+        string = NULL;
+        ids[pos++] = strtoul(s, NULL, 0);
+    }
+    return pos;
+}
+
 //---------------------------------------------------------------------------- 
 /*
   TBD: replace printf()s with something like this
@@ -0,0 +1,264 @@
+/*
+ * cstbase-uhid.c -- fleet of virtual CST Base Stations on Linux, via uhid
+ *
+ * 2014, Tod E. Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ * Each station is a real HID device to the kernel, with the firmware's
+ * VID/PID, report descriptor and a serial number of its own, so the
+ * regular cstbase-tool & cstbase-lib (built with USBLIB_TYPE=HIDRAW)
+ * find and talk to them through /dev/hidraw*, like they would hardware.
+ * The stations themselves are the ones of cstbase-sim.c.
+ *
+ * Create 100 stations, until Ctrl-C (needs write access to /dev/uhid):
+ * sudo ./cstbase-uhid -n 100
+ * ./cstbase-tool --list
+ *
+ * Without -n, the count comes from CSTBASE_SIM_COUNT. USB transfers take as
+ * long as the kernel takes, add to that with CSTBASE_SIM_USB_US (default 0).
+ * Linux only.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>    // for memset(), strcmp(), et al
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>    // for getopt_long()
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/uhid.h>
+
+#include "cstbase-lib.h"
+#include "cstbase-sim.h"
+
+int verbose;
+
+// same as firmware's hid_rpt01 in usb_descriptors.c
+static const uint8_t report_descriptor[] = {
+    0x06, 0x00, 0xff,              // USAGE_PAGE (Vendor Defined Page 1)
+    0x09, 0x01,                    // USAGE (Vendor Usage 1)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x85, 0x01,                    //   REPORT_ID (1)
+    0x95, 8,                       //   REPORT_COUNT (8)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0x85, 0x02,                    //   REPORT_ID (2)
+    0x95, 64,                      //   REPORT_COUNT (64)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0x85, 0x03,                    //   REPORT_ID (3)
+    0x95, 7,                       //   REPORT_COUNT (7)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0x85, 0x04,                    //   REPORT_ID (4)
+    0x95, 64,                      //   REPORT_COUNT (64)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0x85, 0x05,                    //   REPORT_ID (5)
+    0x95, 16,                      //   REPORT_COUNT (16)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0xc0                           // END_COLLECTION
+};
+
+typedef struct uhid_station_ {
+    int fd;
+    int id;
+    cstsim_station* st;
+} uhid_station;
+
+//
+static void usage(char *myName)
+{
+    fprintf(stderr,
+"Usage: \n"
+"  %s [options]\n"
+"where [options] are: \n"
+"  -n num, --count num         Number of stations (default $CSTBASE_SIM_COUNT,\n"
+"                              or 4)\n"
+"  -v, --verbose               Print each report as it's handled\n"
+"\n"
+            ,myName);
+}
+
+// one uhid event, whole or not at all
+static int uhidWrite( int fd, struct uhid_event* ev )
+{
+    ssize_t n;
+    do {
+        n = write( fd, ev, sizeof(*ev) );
+    } while( n < 0 && errno == EINTR );
+    return ( n == sizeof(*ev) ) ? 0 : -1;
+}
+
+// length of report with given id, including report id byte
+static int reportLen( uint8_t id )
+{
+    if( id == cstbase_batch_report_id ) return cstbase_batch_buf_size;
+    if( id == cstbase_resp_report_id )  return cstbase_resp_buf_size;
+    if( id == cstbase_status_report_id ) return cstbase_status_buf_size;
+    return cstbase_buf_size;
+}
+
+//
+static int createDevice( uhid_station* us )
+{
+    struct uhid_event ev;
+    memset( &ev, 0, sizeof(ev) );
+    ev.type = UHID_CREATE2;
+    snprintf( (char*)ev.u.create2.name, sizeof(ev.u.create2.name),
+              "ThingM CST Base (sim %d)", us->id );
+    snprintf( (char*)ev.u.create2.phys, sizeof(ev.u.create2.phys),
+              "cstbase-uhid/%d", us->id );
+    strncpy( (char*)ev.u.create2.uniq, cstsim_serial(us->id),
+             sizeof(ev.u.create2.uniq)-1 );
+    memcpy( ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor) );
+    ev.u.create2.rd_size = sizeof(report_descriptor);
+    ev.u.create2.bus     = BUS_USB;
+    ev.u.create2.vendor  = CSTBASE_VENDOR_ID;
+    ev.u.create2.product = CSTBASE_DEVICE_ID;
+    ev.u.create2.version = 0x0200;
+    return uhidWrite( us->fd, &ev );
+}
+
+// answers the kernel's SET_REPORTs & GET_REPORTs for one station
+static void* requestThread( void* arg )
+{
+    uhid_station* us = arg;
+    struct uhid_event ev, reply;
+
+    while( 1 ) {
+        ssize_t n = read( us->fd, &ev, sizeof(ev) );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) break;
+
+        memset( &reply, 0, sizeof(reply) );
+        if( ev.type == UHID_SET_REPORT ) {
+            int rc = -1;
+            if( ev.u.set_report.rtype == UHID_FEATURE_REPORT )
+                rc = cstsim_setReport( us->st, ev.u.set_report.data,
+                                       ev.u.set_report.size );
+            if( verbose ) printf("%d: set %d: %c rc=%d\n", us->id,
+                          ev.u.set_report.rnum, ev.u.set_report.data[1], rc);
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id  = ev.u.set_report.id;
+            reply.u.set_report_reply.err = (rc < 0) ? EIO : 0;
+        }
+        else if( ev.type == UHID_GET_REPORT ) {
+            int rc = -1;
+            uint8_t* buf = reply.u.get_report_reply.data;
+            buf[0] = ev.u.get_report.rnum;
+            if( ev.u.get_report.rtype == UHID_FEATURE_REPORT )
+                rc = cstsim_getReport( us->st, buf, reportLen( buf[0] ) );
+            if( verbose ) printf("%d: get %d: rc=%d\n", us->id, buf[0], rc);
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id   = ev.u.get_report.id;
+            reply.u.get_report_reply.err  = (rc < 0) ? EIO : 0;
+            reply.u.get_report_reply.size = (rc < 0) ? 0 : rc;
+        }
+        else {
+            continue;  // START, OPEN, CLOSE, OUTPUT, nothing to do
+        }
+        if( uhidWrite( us->fd, &reply ) == -1 ) break;
+    }
+    fprintf(stderr, "cstbase-uhid: station %d: %s\n", us->id, strerror(errno));
+    return NULL;
+}
+
+// pushes a station's events as input reports
+static void* eventThread( void* arg )
+{
+    uhid_station* us = arg;
+    struct uhid_event ev;
+
+    while( 1 ) {
+        memset( &ev, 0, sizeof(ev) );
+        ev.type = UHID_INPUT2;
+        int rc = cstsim_readInput( us->st, ev.u.input2.data, cstbase_buf_size-1, -1 );
+        if( rc <= 0 ) continue;
+        ev.u.input2.size = rc;
+        if( uhidWrite( us->fd, &ev ) == -1 ) break;
+    }
+    return NULL;
+}
+
+//
+int main(int argc, char** argv)
+{
+    // parse options
+    int option_index = 0, opt;
+    char* opt_str = "vhn:";
+    static struct option loptions[] = {
+        {"verbose",    optional_argument, 0,      'v'},
+        {"count",      required_argument, 0,      'n'},
+        {"help",       no_argument,       0,      'h'},
+        {NULL,         0,                 0,      0}
+    };
+    while(1) {
+        opt = getopt_long(argc, argv, opt_str, loptions, &option_index);
+        if (opt==-1) break; // parsed all the args
+        switch (opt) {
+        case 'n':
+            setenv( "CSTBASE_SIM_COUNT", optarg, 1 );
+            break;
+        case 'v':
+            if( optarg==NULL ) verbose++;
+            else verbose = strtol(optarg,NULL,0);
+            break;
+        case 'h':
+        default:
+            usage( "cstbase-uhid" );
+            exit(1);
+            break;
+        }
+    }
+
+    // the kernel's transfers are the USB delay, unless asked for more
+    setenv( "CSTBASE_SIM_USB_US", "0", 0 );
+    if( cstsim_init() != 0 ) {
+        fprintf(stderr, "cstbase-uhid: could not create stations\n");
+        exit(1);
+    }
+    int count = cstsim_count();
+    uhid_station* stations = calloc( count ? count : 1, sizeof(uhid_station) );
+
+    // lots of threads, keep them small
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    pthread_attr_setstacksize( &attr, 64*1024 );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+
+    for( int i=0; i< count; i++ ) {
+        uhid_station* us = &stations[i];
+        us->id = i;
+        us->st = cstsim_openPath( cstsim_path(i) );
+        us->fd = open( "/dev/uhid", O_RDWR | O_CLOEXEC );
+        if( us->fd < 0 || createDevice( us ) == -1 ) {
+            fprintf(stderr, "cstbase-uhid: /dev/uhid: %s\n", strerror(errno));
+            exit(1);
+        }
+        pthread_t thread;
+        if( pthread_create( &thread, &attr, requestThread, us ) != 0 ||
+            pthread_create( &thread, &attr, eventThread, us ) != 0 ) {
+            fprintf(stderr, "cstbase-uhid: could not start station %d\n", i);
+            exit(1);
+        }
+        if( verbose ) printf("station %d: serial %s\n", i, cstsim_serial(i));
+    }
+
+    printf("cstbase-uhid: %d stations, serials %s to %s, Ctrl-C to remove\n",
+           count, count ? cstsim_serial(0) : "-",
+           count ? cstsim_serial(count-1) : "-");
+    fflush(stdout);
+
+    // closing /dev/uhid on exit removes the devices
+    while( 1 ) {
+        pause();
+    }
+    return 0;
+}
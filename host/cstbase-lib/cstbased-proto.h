@@ -0,0 +1,64 @@
+/*
+ * cstbased-proto.h -- wire protocol between cstbased and its clients
+ *
+ * 2014, Tod E. Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ * Every message, in either direction, is a cstbased_hdr followed by
+ * hdr.len bytes of payload. Fields are in host byte order, since both
+ * ends are on the same machine. A client sends one request and reads
+ * one response before sending the next.
+ *
+ * Device ids are cstbased's registry ids, which clients mirror, so an
+ * "arg" that is a device id can also be a serial number, like
+ * cstbase_openById().
+ *
+ */
+
+#ifndef __CSTBASED_PROTO_H__
+#define __CSTBASED_PROTO_H__
+
+#include <stdint.h>
+
+// default socket, "CSTBASED_SOCKET" environment variable overrides
+#define cstbased_socket_path "/tmp/cstbased.sock"
+
+#define cstbased_magic 0xCB
+
+#define cstbased_payload_max 256
+
+typedef struct cstbased_hdr_ {
+    uint8_t  magic;    // cstbased_magic
+    uint8_t  op;       // request op, echoed in response
+    uint16_t len;      // payload bytes that follow
+    int32_t  arg;      // request: device id (or serial), response: rc
+} cstbased_hdr;
+
+// request ops
+enum {
+    // rescan (unless daemon follows hotplug). rc = number of ids
+    CSTBASED_OP_ENUMERATE = 1,
+    // arg = id. payload back = cstbased_info. rc = 0, -1 for bad id
+    CSTBASED_OP_INFO,
+    // arg = id or serial. daemon opens (pooled). rc = id or -1
+    CSTBASED_OP_OPEN,
+    // arg = id, payload = report. rc as cstbase_write()
+    CSTBASED_OP_WRITE,
+    // arg = id, payload = report (buf[0] report id, any but 3). 
+    // same back, rc as cstbase_read()
+    CSTBASED_OP_READ,
+    // arg = id, payload = query report, batch frame, or none. 
+    // response report back, rc as cstbase_transact()
+    CSTBASED_OP_TRANSACT,
+    // arg = id, payload = int32_t timeout millis. waits for an event, 
+    // its input report back, rc = report length, 0 on timeout, -1 error
+    CSTBASED_OP_READINPUT,
+};
+
+// CSTBASED_OP_INFO payload
+typedef struct cstbased_info_ {
+    uint8_t present;
+    char serial[9];     // serialstrmax
+    char path[128];     // pathstrmax
+} cstbased_info;
+
+#endif
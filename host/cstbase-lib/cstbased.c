@@ -0,0 +1,301 @@
+/*
+ * cstbased.c -- daemon that holds all CST Base Stations open and serves
+ *               cstbase-lib calls to local clients over a Unix socket
+ *
+ * 2014, Tod E. Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ *
+ * Serve on the default socket, /tmp/cstbased.sock:
+ * ./cstbased
+ *
+ * Serve on another socket, printing each device as it comes and goes:
+ * ./cstbased -s /var/run/cstbased.sock -v
+ * CSTBASED_SOCKET=/var/run/cstbased.sock ./cstbase-tool-client --buttons
+ *
+ * Clients are programs linked with the client build of cstbase-lib
+ * ("make client"), which has the same API but no USB setup cost per process.
+ * See cstbased-proto.h for the protocol.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>    // for memset(), strcmp(), et al
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>    // for getopt_long()
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cstbase-lib.h"
+#include "cstbased-proto.h"
+
+#ifndef CSTBASE_THREADSAFE
+#error "cstbased serves clients from several threads, build with THREADSAFE=1"
+#endif
+
+int verbose;
+
+static const char* socketPath;
+static int hotplug;   // registry follows hotplug, no rescans needed
+
+//
+static void usage(char *myName)
+{
+    fprintf(stderr,
+"Usage: \n"
+"  %s [options]\n"
+"where [options] are: \n"
+"  -s path, --socket path      Listen on this socket (default %s,\n"
+"                              or $CSTBASED_SOCKET)\n"
+"  -v, --verbose               Print devices as they come and go\n"
+"\n"
+            ,myName, cstbased_socket_path);
+}
+
+// open every present device, so clients find them pooled & ready
+static void openAll(void)
+{
+    int count = cstbase_getCachedCount();
+    for( int i=0; i< count; i++ ) {
+        if( cstbase_isCachedPresent(i) ) cstbase_openById( i );
+    }
+}
+
+//
+static void hotplugEvent(int arrived, const char* serial, void* userdata)
+{
+    if( verbose ) printf("%s %s\n", arrived ? "arrived" : "removed", serial);
+    if( arrived ) cstbase_openBySerial( serial );
+}
+
+// pooled handle for a device id, NULL if it's not there
+static cstbase_device* devForId( int32_t id )
+{
+    if( id < 0 || id >= cstbase_getCachedCount() ) return NULL;
+    return cstbase_openById( id );
+}
+
+// send or receive exactly len bytes
+static int io( int fd, void* buf, int len, int sending )
+{
+    uint8_t* p = buf;
+    while( len > 0 ) {
+        ssize_t n = sending ? write( fd, p, len ) : read( fd, p, len );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// length of report with given id, including report id byte
+static int reportLen( uint8_t id )
+{
+    if( id == cstbase_batch_report_id ) return cstbase_batch_buf_size;
+    if( id == cstbase_resp_report_id )  return cstbase_resp_buf_size;
+    if( id == cstbase_status_report_id ) return cstbase_status_buf_size;
+    return cstbase_buf_size;
+}
+
+// do one request, turning hdr & payload into the response
+static void handleRequest( cstbased_hdr* hdr, uint8_t* payload )
+{
+    int32_t arg = hdr->arg;
+    int len = hdr->len;
+    cstbase_device* dev;
+
+    hdr->len = 0;
+    hdr->arg = -1;
+
+    switch( hdr->op ) {
+    case CSTBASED_OP_ENUMERATE:
+        if( !hotplug ) {
+            cstbase_enumerate();
+            openAll();
+        }
+        hdr->arg = cstbase_getCachedCount();
+        break;
+    case CSTBASED_OP_INFO: {
+        const char* serial = cstbase_getCachedSerial( arg );
+        const char* path   = cstbase_getCachedPath( arg );
+        if( serial == NULL || path == NULL ) break;
+        cstbased_info info;
+        memset( &info, 0, sizeof(info) );
+        info.present = cstbase_isCachedPresent( arg );
+        strncpy( info.serial, serial, sizeof(info.serial)-1 );
+        strncpy( info.path, path, sizeof(info.path)-1 );
+        memcpy( payload, &info, sizeof(info) );
+        hdr->len = sizeof(info);
+        hdr->arg = 0;
+        break;
+    }
+    case CSTBASED_OP_OPEN:
+        dev = cstbase_openById( (uint32_t)arg );
+        if( dev == NULL ) break;
+        hdr->arg = cstbase_getCacheIndexByDev( dev );
+        if( hdr->arg == -1 ) cstbase_close( dev );  // not one we can pool
+        break;
+    case CSTBASED_OP_WRITE:
+        dev = devForId( arg );
+        if( dev == NULL || len == 0 || len != reportLen( payload[0] ) ) break;
+        hdr->arg = cstbase_write( dev, payload, len );
+        break;
+    case CSTBASED_OP_READ:
+        dev = devForId( arg );
+        if( dev == NULL || len == 0 || len != reportLen( payload[0] ) ) break;
+        hdr->arg = cstbase_read( dev, payload, len );
+        hdr->len = len;
+        break;
+    case CSTBASED_OP_TRANSACT:
+        dev = devForId( arg );
+        if( dev == NULL ) break;
+        if( len != 0 && len != reportLen( payload[0] ) ) break;
+        hdr->arg = cstbase_transact( dev, len ? payload : NULL, payload );
+        hdr->len = len ? len : cstbase_buf_size;
+        break;
+    case CSTBASED_OP_READINPUT: {
+        // events go to whichever client asks first
+        cstbase_event ev;
+        int32_t timeout;
+        dev = devForId( arg );
+        if( dev == NULL || len != sizeof(timeout) ) break;
+        memcpy( &timeout, payload, sizeof(timeout) );
+        hdr->arg = cstbase_readEvent( dev, &ev, timeout );
+        if( hdr->arg != 1 ) break;
+        memset( payload, 0, cstbase_buf_size );
+        payload[0] = cstbase_event_report_id;
+        payload[1] = ev.type;
+        payload[2] = ev.data;
+        payload[3] = ev.seq;
+        payload[4] = ev.dropped;
+        hdr->arg = hdr->len = cstbase_buf_size;
+        break;
+    }
+    }
+}
+
+// one per client connection, until it hangs up
+static void* clientThread( void* arg )
+{
+    int fd = (int)(intptr_t)arg;
+    cstbased_hdr hdr;
+    uint8_t payload[cstbased_payload_max];
+
+    while( io( fd, &hdr, sizeof(hdr), 0 ) == 0 ) {
+        if( hdr.magic != cstbased_magic || hdr.len > sizeof(payload) ) break;
+        if( hdr.len && io( fd, payload, hdr.len, 0 ) == -1 ) break;
+        handleRequest( &hdr, payload );
+        if( io( fd, &hdr, sizeof(hdr), 1 ) == -1 ) break;
+        if( hdr.len && io( fd, payload, hdr.len, 1 ) == -1 ) break;
+    }
+    close( fd );
+    return NULL;
+}
+
+// delivers hotplug events
+static void* eventThread( void* arg )
+{
+    while( 1 ) {
+        cstbase_handleEvents( 1000 );
+    }
+    return NULL;
+}
+
+//
+static void onSignal( int sig )
+{
+    unlink( socketPath );
+    _exit( 0 );
+}
+
+//
+int main(int argc, char** argv)
+{
+    socketPath = getenv("CSTBASED_SOCKET");
+    if( socketPath == NULL ) socketPath = cstbased_socket_path;
+
+    // parse options
+    int option_index = 0, opt;
+    char* opt_str = "vhs:";
+    static struct option loptions[] = {
+        {"verbose",    optional_argument, 0,      'v'},
+        {"socket",     required_argument, 0,      's'},
+        {"help",       no_argument,       0,      'h'},
+        {NULL,         0,                 0,      0}
+    };
+    while(1) {
+        opt = getopt_long(argc, argv, opt_str, loptions, &option_index);
+        if (opt==-1) break; // parsed all the args
+        switch (opt) {
+        case 's':
+            socketPath = optarg;
+            break;
+        case 'v':
+            if( optarg==NULL ) verbose++;
+            else verbose = strtol(optarg,NULL,0);
+            break;
+        case 'h':
+        default:
+            usage( "cstbased" );
+            exit(1);
+            break;
+        }
+    }
+
+    if( cstbase_init() != 0 ) {
+        fprintf(stderr, "cstbased: could not init USB\n");
+        exit(1);
+    }
+    hotplug = ( cstbase_hotplugStart( hotplugEvent, NULL ) == 0 );
+    if( !hotplug ) cstbase_enumerate();
+    openAll();
+
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, socketPath, sizeof(addr.sun_path)-1 );
+
+    int lfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    unlink( socketPath );  // left over from a previous run
+    if( lfd < 0 || bind( lfd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ||
+        listen( lfd, 16 ) < 0 ) {
+        fprintf(stderr, "cstbased: %s: %s\n", socketPath, strerror(errno));
+        exit(1);
+    }
+
+    signal( SIGPIPE, SIG_IGN );  // clients going away is not our problem
+    signal( SIGINT,  onSignal );
+    signal( SIGTERM, onSignal );
+
+    pthread_t thread;
+    if( hotplug ) pthread_create( &thread, NULL, eventThread, NULL );
+
+    printf("cstbased: %d devices, %s, listening on %s\n",
+           cstbase_getCachedCount(),
+           hotplug ? "following hotplug" : "rescan on enumerate", socketPath);
+    fflush(stdout);
+
+    while( 1 ) {
+        int fd = accept( lfd, NULL, NULL );
+        if( fd < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) continue;
+            fprintf(stderr, "cstbased: accept: %s\n", strerror(errno));
+            break;
+        }
+        if( pthread_create( &thread, NULL, clientThread,
+                            (void*)(intptr_t)fd ) != 0 ) {
+            close( fd );
+            continue;
+        }
+        pthread_detach( thread );
+    }
+
+    unlink( socketPath );
+    cstbase_shutdown();
+    return 1;
+}
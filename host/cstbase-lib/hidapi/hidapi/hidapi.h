@@ -377,6 +377,112 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
+		/* Extensions, libusb implementation only (hidapi/libusb/hid.c) */
+
+		/** @brief Completion callback for asynchronous feature reports.
+
+			@param device The device the transfer was submitted on.
+			@param result The number of bytes transferred, including
+				the report number, or -1 on error.
+			@param data The buffer passed in at submit time. For
+				hid_get_feature_report_async() it holds the report.
+			@param user_data The pointer passed in at submit time.
+		*/
+		typedef void (HID_API_CALL *hid_feature_callback)(hid_device *device, int result, unsigned char *data, void *user_data);
+
+		/** @brief Send a Feature report without blocking.
+
+			Like hid_send_feature_report(), but returns as soon as the
+			Set_Report control transfer has been submitted. @p callback
+			is called from whichever thread is handling libusb events,
+			see hid_handle_events(). @p data must stay valid until then.
+
+			@returns
+				0 if the transfer was submitted and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_send_feature_report_async(hid_device *device, const unsigned char *data, size_t length, hid_feature_callback callback, void *user_data);
+
+		/** @brief Get a Feature report without blocking.
+
+			Like hid_get_feature_report(), but returns as soon as the
+			Get_Report control transfer has been submitted. The report
+			is copied into @p data before @p callback is called.
+
+			@returns
+				0 if the transfer was submitted and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_feature_report_async(hid_device *device, unsigned char *data, size_t length, hid_feature_callback callback, void *user_data);
+
+		/** @brief Start reading input reports on first use, not at open.
+
+			Normally each open device gets a thread that keeps an
+			interrupt IN transfer pending, so input reports queue up
+			from hid_open() on. With @p lazy non-zero, devices opened
+			afterwards start it on their first hid_read() or
+			hid_read_timeout() instead. Input reports sent before that
+			are not queued. Devices used only for feature reports then
+			cost no thread and no USB traffic while idle. Completion
+			callbacks of asynchronous transfers then only run from
+			hid_handle_events().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_set_lazy_read(int lazy);
+
+		/** @brief Set how many input reports each device queues.
+
+			Applies to devices whose reading starts afterwards (see
+			hid_set_lazy_read()). Slots for this many reports are
+			allocated up front. When the queue is full, newly arrived
+			reports are dropped, see hid_get_input_reports_dropped().
+			The default is 32.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_set_input_queue_depth(int reports);
+
+		/** @brief Number of input reports dropped on a full queue.
+
+			@returns
+				The count since hid_open(), wrapping at UINT_MAX.
+		*/
+		unsigned int HID_API_EXPORT HID_API_CALL hid_get_input_reports_dropped(hid_device *device);
+
+		/** @brief Handle pending libusb events, running completion callbacks.
+
+			@param milliseconds Maximum time to wait for an event.
+			@param completed If not NULL, return early once this
+				becomes non-zero (set it from a callback).
+
+			@returns
+				0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_handle_events(int milliseconds, int *completed);
+
+		/** @brief Hotplug callback for devices arriving or leaving.
+
+			@param arrived 1 if the device was plugged in, 0 if it
+				was removed.
+			@param info The device, as hid_enumerate() would have
+				returned it. Only valid during the callback.
+			@param user_data The pointer passed to hid_hotplug_register().
+		*/
+		typedef void (HID_API_CALL *hid_hotplug_callback)(int arrived, struct hid_device_info *info, void *user_data);
+
+		/** @brief Watch for devices matching a VID/PID coming and going.
+
+			@p callback is called once for each matching device already
+			present before this returns, then from hid_handle_events()
+			for each later arrival or removal. Only one registration
+			at a time; registering again replaces the previous one.
+			Callbacks are never run by two threads at once, and must
+			not call hid_hotplug_register() or hid_hotplug_deregister().
+
+			@returns
+				0 on success and -1 on error or if the platform's
+				libusb has no hotplug support.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data);
+
+		/** @brief Stop hotplug callbacks started by hid_hotplug_register(). */
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_deregister(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -71,11 +71,20 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
-struct input_report {
-	uint8_t *data;
-	size_t len;
-	struct input_report *next;
+/* Ring of input reports received from the device. read_callback() is the
+   only producer (one transfer in flight per device) and puts reports in
+   without a lock. Readers take them out holding dev->mutex, so several
+   threads may call hid_read() on one device. Slots are
+   allocated when the read thread starts. head and tail count reports
+   ever put and taken; the slot is the count modulo depth. */
+struct input_ring {
+	unsigned char *slots; /* depth slots of slot_size bytes */
+	int *lens;
+	unsigned int depth;
+	size_t slot_size;
+	unsigned int head; /* written by the producer only */
+	unsigned int tail; /* written by readers, under dev->mutex */
+	unsigned int dropped; /* reports that found the ring full */
 };
 
 
@@ -101,20 +110,22 @@ struct hid_device_ {
 
 	/* Read thread objects */
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* For waiting on condition */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
+	int thread_started; /* read thread runs, see hid_set_lazy_read() */
 	int shutdown_thread;
 	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Received input reports. */
+	struct input_ring ring;
 };
 
 static libusb_context *usb_context = NULL;
+static int lazy_read = 0; /* start read threads on first read, not at open */
+static unsigned int input_queue_depth = 32; /* for read threads started next */
 
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
 
 static hid_device *new_hid_device(void)
 {
@@ -135,6 +146,10 @@ static void free_hid_device(hid_device *dev)
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	/* Free the input report slots */
+	free(dev->ring.slots);
+	free(dev->ring.lens);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -402,6 +417,95 @@ static char *make_path(libusb_device *dev, int interface_number)
 	return strdup(str);
 }
 
+/* Path cache. Remembers which libusb_device a path belongs to, so that
+   hid_open_path() for a path hid_enumerate() (or an earlier open) already
+   found doesn't walk the whole device list again. Entries hold a reference
+   on the device. An entry for an unplugged device fails to open, and is
+   then dropped. */
+#define PATH_CACHE_SIZE 128
+
+struct path_cache_entry {
+	char path[32];
+	libusb_device *usb_dev;
+};
+
+static pthread_mutex_t path_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+static int path_cache_next = 0; /* slot to reuse when full */
+
+static void path_cache_add(const char *path, libusb_device *usb_dev)
+{
+	struct path_cache_entry *e = NULL;
+	int i;
+
+	pthread_mutex_lock(&path_cache_mutex);
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (path_cache[i].usb_dev && !strcmp(path_cache[i].path, path)) {
+			e = &path_cache[i];
+			break;
+		}
+		if (!e && !path_cache[i].usb_dev)
+			e = &path_cache[i];
+	}
+	if (!e) {
+		e = &path_cache[path_cache_next];
+		path_cache_next = (path_cache_next + 1) % PATH_CACHE_SIZE;
+	}
+	if (e->usb_dev != usb_dev) {
+		if (e->usb_dev)
+			libusb_unref_device(e->usb_dev);
+		e->usb_dev = libusb_ref_device(usb_dev);
+	}
+	snprintf(e->path, sizeof(e->path), "%s", path);
+	pthread_mutex_unlock(&path_cache_mutex);
+}
+
+/* Returns a new reference, or NULL if path isn't cached. */
+static libusb_device *path_cache_get(const char *path)
+{
+	libusb_device *usb_dev = NULL;
+	int i;
+
+	pthread_mutex_lock(&path_cache_mutex);
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (path_cache[i].usb_dev && !strcmp(path_cache[i].path, path)) {
+			usb_dev = libusb_ref_device(path_cache[i].usb_dev);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&path_cache_mutex);
+	return usb_dev;
+}
+
+static void path_cache_drop(const char *path)
+{
+	int i;
+
+	pthread_mutex_lock(&path_cache_mutex);
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (path_cache[i].usb_dev && !strcmp(path_cache[i].path, path)) {
+			libusb_unref_device(path_cache[i].usb_dev);
+			path_cache[i].usb_dev = NULL;
+		}
+	}
+	pthread_mutex_unlock(&path_cache_mutex);
+}
+
+static void path_cache_clear(void)
+{
+	int i;
+
+	pthread_mutex_lock(&path_cache_mutex);
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (path_cache[i].usb_dev) {
+			libusb_unref_device(path_cache[i].usb_dev);
+			path_cache[i].usb_dev = NULL;
+		}
+	}
+	path_cache_next = 0;
+	pthread_mutex_unlock(&path_cache_mutex);
+}
+
 
 int HID_API_EXPORT hid_init(void)
 {
@@ -424,6 +528,8 @@ int HID_API_EXPORT hid_init(void)
 int HID_API_EXPORT hid_exit(void)
 {
 	if (usb_context) {
+		hid_hotplug_deregister();
+		path_cache_clear();
 		libusb_exit(usb_context);
 		usb_context = NULL;
 	}
@@ -488,6 +594,7 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 							/* Fill out the record */
 							cur_dev->next = NULL;
 							cur_dev->path = make_path(dev, interface_num);
+							path_cache_add(cur_dev->path, dev);
 
 							res = libusb_open(dev, &handle);
 
@@ -647,39 +754,33 @@ static void read_callback(struct libusb_transfer *transfer)
 	int res;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
-		pthread_mutex_lock(&dev->mutex);
-
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+		struct input_ring *ring = &dev->ring;
+		unsigned int head = ring->head;
+		unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		if (head - tail >= ring->depth) {
+			/* Full. Drop this one, the reader can't have gaps
+			   in what it already has. */
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
+			unsigned int i = head % ring->depth;
+			int len = transfer->actual_length;
+			if ((size_t)len > ring->slot_size)
+				len = ring->slot_size;
+			memcpy(ring->slots + i * ring->slot_size, transfer->buffer, len);
+			ring->lens[i] = len;
+			__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+			/* If the reader had taken everything, it may be
+			   waiting. Checked after publishing, so that either
+			   it sees the report or we see it may be waiting. */
+			if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) {
+				pthread_mutex_lock(&dev->mutex);
+				pthread_cond_signal(&dev->condition);
+				pthread_mutex_unlock(&dev->mutex);
 			}
 		}
-		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
 		dev->shutdown_thread = 1;
@@ -776,123 +877,178 @@ static void *read_thread(void *param)
 }
 
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+/* Start the read thread, unless it runs already. Returns 0 if it runs. */
+static int start_read_thread(hid_device *dev)
 {
-	hid_device *dev = NULL;
+	int res = 0;
 
-	libusb_device **devs;
-	libusb_device *usb_dev;
+	pthread_mutex_lock(&dev->mutex);
+	if (!dev->thread_started && !dev->ring.slots) {
+		struct input_ring *ring = &dev->ring;
+		ring->depth = input_queue_depth;
+		ring->slot_size = dev->input_ep_max_packet_size;
+		ring->slots = malloc(ring->depth * ring->slot_size);
+		ring->lens = calloc(ring->depth, sizeof(int));
+		if (!ring->slots || !ring->lens) {
+			free(ring->slots);
+			free(ring->lens);
+			ring->slots = NULL;
+			ring->lens = NULL;
+			res = -1;
+		}
+	}
+	if (!dev->thread_started && res == 0) {
+		res = pthread_create(&dev->thread, NULL, read_thread, dev);
+		if (res == 0) {
+			/* Wait here for the read thread to be initialized. */
+			pthread_barrier_wait(&dev->barrier);
+			dev->thread_started = 1;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return (res == 0) ? 0 : -1;
+}
+
+/* Open the HID interface of usb_dev that has the given path, if it has one.
+   Returns 1 if dev is now open. */
+static int open_path_on_device(hid_device *dev, libusb_device *usb_dev, const char *path)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
 	int res;
-	int d = 0;
+	int i,j,k;
 	int good_open = 0;
 
-	dev = new_hid_device();
+	libusb_get_device_descriptor(usb_dev, &desc);
 
-	if(hid_init() < 0)
-		return NULL;
-
-	libusb_get_device_list(usb_context, &devs);
-	while ((usb_dev = devs[d++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
-		libusb_get_device_descriptor(usb_dev, &desc);
-
-		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
-			continue;
-		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-			const struct libusb_interface *intf = &conf_desc->interface[j];
-			for (k = 0; k < intf->num_altsetting; k++) {
-				const struct libusb_interface_descriptor *intf_desc;
-				intf_desc = &intf->altsetting[k];
-				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
-					if (!strcmp(dev_path, path)) {
-						/* Matched Paths. Open this device */
-
-						/* OPEN HERE */
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
-							break;
-						}
-						good_open = 1;
+	if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+		return 0;
+	for (j = 0; j < conf_desc->bNumInterfaces && !good_open; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting && !good_open; k++) {
+			const struct libusb_interface_descriptor *intf_desc;
+			intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+				char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
+				if (!strcmp(dev_path, path)) {
+					/* Matched Paths. Open this device */
+
+					/* OPEN HERE */
+					res = libusb_open(usb_dev, &dev->device_handle);
+					if (res < 0) {
+						LOG("can't open device\n");
+						free(dev_path);
+						break;
+					}
+					good_open = 1;
 #ifdef DETACH_KERNEL_DRIVER
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-#endif
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+					/* Detach the kernel driver, but only if the
+					   device is managed by the kernel */
+					if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
+						res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
 						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-							free(dev_path);
 							libusb_close(dev->device_handle);
+							LOG("Unable to detach Kernel Driver\n");
+							free(dev_path);
 							good_open = 0;
 							break;
 						}
+					}
+#endif
+					res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+					if (res < 0) {
+						LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+						free(dev_path);
+						libusb_close(dev->device_handle);
+						good_open = 0;
+						break;
+					}
 
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for intput or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
+					/* Store off the string descriptor indexes */
+					dev->manufacturer_index = desc.iManufacturer;
+					dev->product_index      = desc.iProduct;
+					dev->serial_index       = desc.iSerialNumber;
+
+					/* Store off the interface number */
+					dev->interface = intf_desc->bInterfaceNumber;
+
+					/* Find the INPUT and OUTPUT endpoints. An
+					   OUTPUT endpoint is not required. */
+					for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+						const struct libusb_endpoint_descriptor *ep
+							= &intf_desc->endpoint[i];
+
+						/* Determine the type and direction of this
+						   endpoint. */
+						int is_interrupt =
+							(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+						      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+						int is_output =
+							(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+						      == LIBUSB_ENDPOINT_OUT;
+						int is_input =
+							(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+						      == LIBUSB_ENDPOINT_IN;
+
+						/* Decide whether to use it for intput or output. */
+						if (dev->input_endpoint == 0 &&
+						    is_interrupt && is_input) {
+							/* Use this endpoint for INPUT */
+							dev->input_endpoint = ep->bEndpointAddress;
+							dev->input_ep_max_packet_size = ep->wMaxPacketSize;
 						}
+						if (dev->output_endpoint == 0 &&
+						    is_interrupt && is_output) {
+							/* Use this endpoint for OUTPUT */
+							dev->output_endpoint = ep->bEndpointAddress;
+						}
+					}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
+					if (!lazy_read)
+						start_read_thread(dev);
 
-					}
-					free(dev_path);
 				}
+				free(dev_path);
 			}
 		}
-		libusb_free_config_descriptor(conf_desc);
+	}
+	libusb_free_config_descriptor(conf_desc);
 
+	return good_open;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_device *dev = NULL;
+
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	int d = 0;
+	int good_open = 0;
+
+	dev = new_hid_device();
+
+	if(hid_init() < 0)
+		return NULL;
+
+	/* Known path, no need to look at every device on the bus */
+	usb_dev = path_cache_get(path);
+	if (usb_dev) {
+		good_open = open_path_on_device(dev, usb_dev, path);
+		libusb_unref_device(usb_dev);
+		if (good_open)
+			return dev;
+		path_cache_drop(path);
+	}
+
+	libusb_get_device_list(usb_context, &devs);
+	while ((usb_dev = devs[d++]) != NULL) {
+		if (open_path_on_device(dev, usb_dev, path)) {
+			path_cache_add(path, usb_dev);
+			good_open = 1;
+			break;
+		}
 	}
 
 	libusb_free_device_list(devs, 1);
@@ -960,19 +1116,29 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 }
 
 /* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+   This should be called with dev->mutex locked. Returns 1 with the oldest
+   report copied into data (and its length in *len), 0 if there is none. */
+static int ring_pop(hid_device *dev, unsigned char *data, size_t length, int *len)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
-	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
-	return len;
+	struct input_ring *ring = &dev->ring;
+	unsigned int tail = ring->tail;
+	unsigned int i;
+	size_t n;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+		return 0;
+	i = tail % ring->depth;
+	n = (length < (size_t)ring->lens[i])? length: (size_t)ring->lens[i];
+	if (n > 0)
+		memcpy(data, ring->slots + i * ring->slot_size, n);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	*len = n;
+
+	/* read_callback() only wakes one reader when the ring was empty,
+	   pass it on if there's more for another waiting one. */
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail + 1)
+		pthread_cond_signal(&dev->condition);
+	return 1;
 }
 
 static void cleanup_mutex(void *param)
@@ -993,15 +1159,15 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	return transferred;
 #endif
 
+	if (!dev->thread_started && start_read_thread(dev) < 0)
+		return -1;
+
 	pthread_mutex_lock(&dev->mutex);
 	pthread_cleanup_push(&cleanup_mutex, dev);
 
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
+	if (ring_pop(dev, data, length, &bytes_read))
 		goto ret;
-	}
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
@@ -1012,12 +1178,9 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!ring_pop(dev, data, length, &bytes_read) && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
 	}
 	else if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
@@ -1031,13 +1194,11 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!ring_pop(dev, data, length, &bytes_read) && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
 			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
+				if (ring_pop(dev, data, length, &bytes_read))
 					break;
-				}
 
 				/* If we're here, there was a spurious wake up
 				   or the read thread was shutdown. Run the
@@ -1072,6 +1233,22 @@ int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
 }
 
+void HID_API_EXPORT hid_set_lazy_read(int lazy)
+{
+	lazy_read = lazy;
+}
+
+void HID_API_EXPORT hid_set_input_queue_depth(int reports)
+{
+	if (reports > 0)
+		input_queue_depth = reports;
+}
+
+unsigned int HID_API_EXPORT hid_get_input_reports_dropped(hid_device *dev)
+{
+	return __atomic_load_n(&dev->ring.dropped, __ATOMIC_RELAXED);
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	dev->blocking = !nonblock;
@@ -1140,22 +1317,325 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 	return res;
 }
 
+/* One asynchronous feature report transfer. The setup packet and
+   report data live in buf, right after this struct. */
+struct async_feature {
+	hid_device *dev;
+	hid_feature_callback callback;
+	void *user_data;
+	unsigned char *data;
+	int skipped_report_id;
+	unsigned char buf[];
+};
+
+static void async_feature_callback(struct libusb_transfer *transfer)
+{
+	struct async_feature *af = transfer->user_data;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		res = transfer->actual_length;
+		if ((transfer->buffer[0] & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+			memcpy(af->data + af->skipped_report_id,
+			       libusb_control_transfer_get_data(transfer), res);
+		}
+		if (af->skipped_report_id)
+			res++;
+	}
+	else {
+		LOG("async feature transfer status: %d\n", transfer->status);
+	}
+
+	af->callback(af->dev, res, af->data, af->user_data);
+
+	libusb_free_transfer(transfer);
+	free(af);
+}
+
+static int submit_feature_async(hid_device *dev, int direction, int request, unsigned char *data, size_t length, hid_feature_callback callback, void *user_data)
+{
+	struct async_feature *af;
+	struct libusb_transfer *transfer;
+	int skipped_report_id = 0;
+	int report_number = data[0];
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	af = malloc(sizeof(*af) + LIBUSB_CONTROL_SETUP_SIZE + length);
+	transfer = libusb_alloc_transfer(0);
+	if (!af || !transfer) {
+		free(af);
+		libusb_free_transfer(transfer);
+		return -1;
+	}
+	af->dev = dev;
+	af->callback = callback;
+	af->user_data = user_data;
+	af->data = data - skipped_report_id;
+	af->skipped_report_id = skipped_report_id;
+
+	libusb_fill_control_setup(af->buf,
+		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|direction,
+		request,
+		(3/*HID feature*/ << 8) | report_number,
+		dev->interface,
+		length);
+	if (direction == LIBUSB_ENDPOINT_OUT)
+		memcpy(af->buf + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+
+	libusb_fill_control_transfer(transfer, dev->device_handle, af->buf,
+		async_feature_callback, af, 1000/*timeout millis*/);
+
+	if (libusb_submit_transfer(transfer) < 0) {
+		libusb_free_transfer(transfer);
+		free(af);
+		return -1;
+	}
+	return 0;
+}
+
+int HID_API_EXPORT hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_callback callback, void *user_data)
+{
+	return submit_feature_async(dev, LIBUSB_ENDPOINT_OUT, 0x09/*HID set_report*/,
+		(unsigned char *)data, length, callback, user_data);
+}
+
+int HID_API_EXPORT hid_get_feature_report_async(hid_device *dev, unsigned char *data, size_t length, hid_feature_callback callback, void *user_data)
+{
+	return submit_feature_async(dev, LIBUSB_ENDPOINT_IN, 0x01/*HID get_report*/,
+		data, length, callback, user_data);
+}
+
+/* Hotplug. libusb may call hotplug_callback() from any thread handling
+   events (including the read threads), where it can't do I/O, so events
+   are queued and delivered from hid_handle_events(). Arrived devices are
+   remembered so a removal can be reported with the same info.
+   hotplug_mutex guards the pending queue only; hotplug_deliver_mutex is
+   held for a whole delivery, callbacks included, so threads calling
+   hid_handle_events() at once can't corrupt the known list or report a
+   removal before its arrival. */
+struct hotplug_device {
+	libusb_device *usb_dev;
+	int arrived;
+	struct hid_device_info *info; /* only for known devices */
+	struct hotplug_device *next;
+};
+
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hotplug_deliver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static libusb_hotplug_callback_handle hotplug_handle;
+static int hotplug_registered = 0;
+static hid_hotplug_callback hotplug_user_callback;
+static void *hotplug_user_data;
+static struct hotplug_device *hotplug_pending = NULL; /* not yet delivered */
+static struct hotplug_device *hotplug_known = NULL;   /* arrived, not left */
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *usb_dev, libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_device *hd, **tail;
+
+	hd = calloc(1, sizeof(*hd));
+	if (!hd)
+		return 0;
+	hd->usb_dev = libusb_ref_device(usb_dev);
+	hd->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+
+	/* keep events in order */
+	pthread_mutex_lock(&hotplug_mutex);
+	for (tail = &hotplug_pending; *tail; tail = &(*tail)->next)
+		;
+	*tail = hd;
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	return 0; /* stay registered */
+}
+
+/* Build the hid_device_info for the first HID interface of usb_dev. */
+static struct hid_device_info *hotplug_device_info(libusb_device *usb_dev)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	struct hid_device_info *info;
+	libusb_device_handle *handle;
+	int j, k;
+	int interface_num = -1;
+
+	if (libusb_get_device_descriptor(usb_dev, &desc) < 0)
+		return NULL;
+	if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+		libusb_get_config_descriptor(usb_dev, 0, &conf_desc);
+	if (!conf_desc)
+		return NULL;
+	for (j = 0; j < conf_desc->bNumInterfaces && interface_num < 0; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			if (intf->altsetting[k].bInterfaceClass == LIBUSB_CLASS_HID) {
+				interface_num = intf->altsetting[k].bInterfaceNumber;
+				break;
+			}
+		}
+	}
+	libusb_free_config_descriptor(conf_desc);
+	if (interface_num < 0)
+		return NULL;
+
+	info = calloc(1, sizeof(struct hid_device_info));
+	if (!info)
+		return NULL;
+	info->path = make_path(usb_dev, interface_num);
+	info->vendor_id = desc.idVendor;
+	info->product_id = desc.idProduct;
+	info->release_number = desc.bcdDevice;
+	info->interface_number = interface_num;
+
+	if (libusb_open(usb_dev, &handle) >= 0) {
+		if (desc.iSerialNumber > 0)
+			info->serial_number = get_usb_string(handle, desc.iSerialNumber);
+		if (desc.iManufacturer > 0)
+			info->manufacturer_string = get_usb_string(handle, desc.iManufacturer);
+		if (desc.iProduct > 0)
+			info->product_string = get_usb_string(handle, desc.iProduct);
+		libusb_close(handle);
+	}
+	return info;
+}
+
+static void hotplug_free_list(struct hotplug_device *hd)
+{
+	while (hd) {
+		struct hotplug_device *next = hd->next;
+		hid_free_enumeration(hd->info);
+		libusb_unref_device(hd->usb_dev);
+		free(hd);
+		hd = next;
+	}
+}
+
+/* Deliver queued hotplug events, on the caller's thread. */
+static void hotplug_deliver(void)
+{
+	struct hotplug_device *pending, *hd, **known;
+
+	pthread_mutex_lock(&hotplug_deliver_mutex);
+	pthread_mutex_lock(&hotplug_mutex);
+	pending = hotplug_pending;
+	hotplug_pending = NULL;
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	while ((hd = pending) != NULL) {
+		pending = hd->next;
+		hd->next = NULL;
+
+		for (known = &hotplug_known; *known; known = &(*known)->next) {
+			if ((*known)->usb_dev == hd->usb_dev)
+				break;
+		}
+		if (hd->arrived && !*known) {
+			hd->info = hotplug_device_info(hd->usb_dev);
+			if (hd->info) {
+				hotplug_user_callback(1, hd->info, hotplug_user_data);
+				hd->next = hotplug_known;
+				hotplug_known = hd;
+				continue;
+			}
+		}
+		else if (!hd->arrived && *known) {
+			struct hotplug_device *gone = *known;
+			*known = gone->next;
+			gone->next = NULL;
+			hotplug_user_callback(0, gone->info, hotplug_user_data);
+			hotplug_free_list(gone);
+		}
+		hotplug_free_list(hd);
+	}
+	pthread_mutex_unlock(&hotplug_deliver_mutex);
+}
+
+int HID_API_EXPORT hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data)
+{
+	int res;
+
+	if (hid_init() < 0)
+		return -1;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -1;
+	hid_hotplug_deregister();
+
+	hotplug_user_callback = callback;
+	hotplug_user_data = user_data;
+	res = libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		vendor_id ? vendor_id : LIBUSB_HOTPLUG_MATCH_ANY,
+		product_id ? product_id : LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_callback, NULL, &hotplug_handle);
+	if (res != LIBUSB_SUCCESS)
+		return -1;
+	hotplug_registered = 1;
+
+	/* LIBUSB_HOTPLUG_ENUMERATE queued the devices already present */
+	hotplug_deliver();
+	return 0;
+}
+
+void HID_API_EXPORT hid_hotplug_deregister(void)
+{
+	if (!hotplug_registered)
+		return;
+	libusb_hotplug_deregister_callback(usb_context, hotplug_handle);
+	hotplug_registered = 0;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	hotplug_free_list(hotplug_pending);
+	hotplug_pending = NULL;
+	pthread_mutex_unlock(&hotplug_mutex);
+	pthread_mutex_lock(&hotplug_deliver_mutex);
+	hotplug_free_list(hotplug_known);
+	hotplug_known = NULL;
+	pthread_mutex_unlock(&hotplug_deliver_mutex);
+}
+
+
+int HID_API_EXPORT hid_handle_events(int milliseconds, int *completed)
+{
+	struct timeval tv;
+	int res;
+
+	if (hid_init() < 0)
+		return -1;
+
+	tv.tv_sec = milliseconds / 1000;
+	tv.tv_usec = (milliseconds % 1000) * 1000;
+	res = libusb_handle_events_timeout_completed(usb_context, &tv, completed);
+	if (hotplug_registered)
+		hotplug_deliver();
+	if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED && res != LIBUSB_ERROR_TIMEOUT)
+		return -1;
+	return 0;
+}
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	if (dev->thread_started) {
+		/* Cause read_thread() to stop. */
+		dev->shutdown_thread = 1;
+		libusb_cancel_transfer(dev->transfer);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+		/* Clean up the Transfer objects allocated in read_thread(). */
+		free(dev->transfer->buffer);
+		libusb_free_transfer(dev->transfer);
+	}
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1163,13 +1643,7 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
+	/* The queue of received reports goes with the device. */
 	free_hid_device(dev);
 }
 
@@ -275,7 +275,17 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 			           &serial_number_utf8,
 			           &product_name_utf8);
 
-			if (bus_type == BUS_BLUETOOTH) {
+			/* USB devices have their strings on the parent USB
+			   device node, except virtual (uhid) ones which have
+			   none and are handled like Bluetooth. */
+			parent = NULL;
+			if (bus_type != BUS_BLUETOOTH)
+				parent = udev_device_get_parent_with_subsystem_devtype(
+					   udev_dev,
+					   "usb",
+					   "usb_device");
+
+			if (!parent) {
 				switch (key) {
 					case DEVICE_STRING_MANUFACTURER:
 						wcsncpy(string, L"", maxlen);
@@ -296,29 +306,23 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 				}
 			}
 			else {
-				/* This is a USB device. Find its parent USB Device node. */
-				parent = udev_device_get_parent_with_subsystem_devtype(
-					   udev_dev,
-					   "usb",
-					   "usb_device");
-				if (parent) {
-					const char *str;
-					const char *key_str = NULL;
-
-					if (key >= 0 && key < DEVICE_STRING_COUNT) {
-						key_str = device_string_names[key];
-					} else {
-						ret = -1;
-						goto end;
-					}
+				/* This is a USB device. Its parent USB Device node has the strings. */
+				const char *str;
+				const char *key_str = NULL;
+
+				if (key >= 0 && key < DEVICE_STRING_COUNT) {
+					key_str = device_string_names[key];
+				} else {
+					ret = -1;
+					goto end;
+				}
 
-					str = udev_device_get_sysattr_value(parent, key_str);
-					if (str) {
-						/* Convert the string from UTF-8 to wchar_t */
-						retm = mbstowcs(string, str, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-						goto end;
-					}
+				str = udev_device_get_sysattr_value(parent, key_str);
+				if (str) {
+					/* Convert the string from UTF-8 to wchar_t */
+					retm = mbstowcs(string, str, maxlen);
+					ret = (retm == (size_t)-1)? -1: 0;
+					goto end;
 				}
 			}
 		}
@@ -363,7 +367,6 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
-	struct hid_device_info *prev_dev = NULL; /* previous device */
 
 	hid_init();
 
@@ -443,7 +446,6 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 			else {
 				root = tmp;
 			}
-			prev_dev = cur_dev;
 			cur_dev = tmp;
 
 			/* Fill out the record */
@@ -477,21 +479,12 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 							"usb_device");
 
 					if (!usb_dev) {
-						/* Free this device */
-						free(cur_dev->serial_number);
-						free(cur_dev->path);
-						free(cur_dev);
-
-						/* Take it off the device list. */
-						if (prev_dev) {
-							prev_dev->next = NULL;
-							cur_dev = prev_dev;
-						}
-						else {
-							cur_dev = root = NULL;
-						}
-
-						goto next;
+						/* Virtual USB devices (uhid) have no USB
+						   parent, take the strings from the HID
+						   device like Bluetooth does. */
+						cur_dev->manufacturer_string = wcsdup(L"");
+						cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+						break;
 					}
 
 					/* Manufacturer and Product strings */
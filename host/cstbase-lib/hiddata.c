@@ -155,11 +155,21 @@ BOOLEAN rval = 0;
 
 /* ------------------------------------------------------------------------ */
 
+/* device is opened without FILE_FLAG_OVERLAPPED, so ReadFile() can't time
+ * out. not supported, use the HIDAPI build on Windows for input reports */
+int usbhidReadInput(usbDevice_t *device, char *buffer, int len, int timeout)
+{
+    return -USBOPEN_ERR_IO;
+}
+
+/* ------------------------------------------------------------------------ */
+
 /* ######################################################################## */
 #else /* defined WIN32 #################################################### */
 /* ######################################################################## */
 
 #include <string.h>
+#include <errno.h>
 #include <usb.h>
 
 #define usbDevice   usb_dev_handle  /* use libusb's device structure */
@@ -171,6 +181,8 @@ BOOLEAN rval = 0;
 
 #define USB_HID_REPORT_TYPE_FEATURE 3
 
+#define USB_HID_INPUT_ENDPOINT  (USB_ENDPOINT_IN | 1)
+
 
 static int  usesReportIDs;
 
@@ -325,6 +337,35 @@ int bytesReceived, maxLen = *len;
     return 0;
 }
 
+/* ------------------------------------------------------------------------- */
+
+int usbhidReadInput(usbDevice_t *device, char *buffer, int len, int timeout)
+{
+int bytesReceived;
+
+    /* interrupt endpoint needs the interface, kernel HID driver may have it */
+#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
+    usb_detach_kernel_driver_np((void *)device, 0);
+#endif
+    if(usb_claim_interface((void *)device, 0) < 0){
+        fprintf(stderr, "Error claiming interface: %s\n", usb_strerror());
+        return -USBOPEN_ERR_ACCESS;
+    }
+    /* libusb-0.1 waits forever on timeout 0 */
+    if(timeout == 0)
+        timeout = 1;
+    else if(timeout < 0)
+        timeout = 0;
+    bytesReceived = usb_interrupt_read((void *)device, USB_HID_INPUT_ENDPOINT, buffer, len, timeout);
+    if(bytesReceived == -ETIMEDOUT)
+        return 0;
+    if(bytesReceived < 0){
+        fprintf(stderr, "Error reading input report: %s\n", usb_strerror());
+        return -USBOPEN_ERR_IO;
+    }
+    return bytesReceived;
+}
+
 /* ######################################################################## */
 #endif /* defined WIN32 ################################################### */
 /* ######################################################################## */
@@ -65,6 +65,14 @@ int usbhidGetReport(usbDevice_t *device, int reportID, char *buffer, int *len);
  * Returns: 0 on success, an error code otherwise.
  */
 
+int usbhidReadInput(usbDevice_t *device, char *buffer, int len, int timeout);
+/* This function reads one input report from the device's interrupt IN
+ * endpoint, waiting up to 'timeout' milliseconds, or forever if negative.
+ * The report (prefixed with the report-ID if the device uses them) is put
+ * in 'buffer', which is 'len' bytes long.
+ * Returns: the length of the report, 0 on timeout, or a negative error code.
+ */
+
 /* ------------------------------------------------------------------------ */
 
 #endif /* __HIDDATA_H_INCLUDED__ */